@@ -22,10 +22,15 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
+#include "iostat.h"
+
+struct iostat iostat;
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  int ra_inflight;  // read-aheads the disk has not finished
 } bcache;
 struct {
   struct spinlock lock;
@@ -63,39 +68,19 @@ binit(void)
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-struct buf*
-bget(uint dev, uint blockno)
+// Find an unused buffer, preferably in bucket, and claim it
+// for (dev, blockno) in that bucket.
+// Caller must hold bcache_buckets[bucket].lock.
+// Returns 0 if every buffer is in use.
+static struct buf*
+brecycle(int bucket, uint dev, uint blockno)
 {
   struct buf *b;
 
-  int bucket = blockno % NBUCKET;
-  acquire(&bcache_buckets[bucket].lock);
-
-  // Is the block already cached?
-  for(b = bcache_buckets[bucket].head.bnext; b != &bcache_buckets[bucket].head; b = b->bnext){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache_buckets[bucket].lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
-
-  // Not cached.
   // Try to find an unused buffer in the bucket.
   for(b = bcache_buckets[bucket].head.bnext; b != &bcache_buckets[bucket].head; b = b->bnext){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache_buckets[bucket].lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+    if(b->refcnt == 0)
+      goto found;
   }
 
   // Recycle from other buckets.
@@ -105,13 +90,8 @@ bget(uint dev, uint blockno)
       continue;
     acquire(&bcache_buckets[i].lock);
     for(b = bcache_buckets[i].head.bnext; b != &bcache_buckets[i].head; b = b->bnext){
-      if(b->refcnt == 0) {
-        b->dev = dev;
-        b->blockno = blockno;
-        b->valid = 0;
-        b->refcnt = 1;
+      if(b->refcnt == 0)
         break;
-      }
     }
     // If we found a buffer to recycle, move it to the head of the
     // list in the bucket we are using.
@@ -123,17 +103,121 @@ bget(uint dev, uint blockno)
       bcache_buckets[bucket].head.bnext->bprev = b;
       bcache_buckets[bucket].head.bnext = b;
       release(&bcache_buckets[i].lock);
-      release(&bcache_buckets[bucket].lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      goto found;
     }
     else
       release(&bcache_buckets[i].lock);
   }
   release(&bcache.lock);
+  return 0;
+
+found:
+  if(b->ra)
+    __sync_fetch_and_add(&iostat.ra_wasted, 1);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->ra = 0;
+  b->refcnt = 1;
+  return b;
+}
+
+// Queue I/O between locked buffer b and disk block blockno,
+// which is usually b's own. If the calling process is plugged,
+// hold it back in the process's plug list; otherwise tell the
+// disk about it right away.
+static void
+bstart(struct buf *b, uint blockno, int write, void (*done)(struct buf *))
+{
+  struct proc *p = myproc();
+
+  b->ioblock = blockno;
+  if(p->plugged){
+    b->iowrite = write;
+    b->iodone = done;
+    b->qnext = 0;
+    if(p->plugtail)
+      p->plugtail->qnext = b;
+    else
+      p->plughead = b;
+    p->plugtail = b;
+    return;
+  }
+  virtio_disk_kick(1 << virtio_disk_submit(b, write, done));
+}
 
-  panic("bget: no buffers");
+// Hand the I/O the calling process held back while
+// plugged to the I/O scheduler, and tell the disk.
+static void
+bflush(void)
+{
+  struct proc *p = myproc();
+  struct buf *b, *next;
+  uint vqs;
+
+  if(p->plughead == 0)
+    return;
+  // the process may move to another hart midway, so
+  // remember each virtqueue that gets some of the I/O.
+  vqs = 0;
+  for(b = p->plughead; b; b = next){
+    next = b->qnext;
+    vqs |= 1 << virtio_disk_submit(b, b->iowrite, b->iodone);
+  }
+  p->plughead = p->plugtail = 0;
+  virtio_disk_kick(vqs);
+}
+
+// Wait for the disk to finish the I/O started on b.
+static void
+bsync(struct buf *b)
+{
+  bflush();
+  virtio_disk_wait(b);
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  int bucket = blockno % NBUCKET;
+  acquire(&bcache_buckets[bucket].lock);
+
+  // Is the block already cached?
+  for(b = bcache_buckets[bucket].head.bnext; b != &bcache_buckets[bucket].head; b = b->bnext){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      release(&bcache_buckets[bucket].lock);
+      acquiresleep(&b->lock);
+      return b;
+    }
+  }
+
+  // Not cached.
+  if((b = brecycle(bucket, dev, blockno)) == 0)
+    panic("bget: no buffers");
+  release(&bcache_buckets[bucket].lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Return a locked buf for the indicated block without reading
+// it, for a caller about to overwrite all of it. Not a bread()
+// call, so iostat.nbread doesn't count it.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  b->ra = 0;
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -142,31 +226,51 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
+  __sync_fetch_and_add(&iostat.nbread, 1);
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    bstart(b, b->blockno, 0, 0);
+    bsync(b);
     b->valid = 1;
+  } else if(b->ra) {
+    __sync_fetch_and_add(&iostat.ra_hits, 1);
   }
+  b->ra = 0;
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
+// Return locked bufs with the contents of the n indicated blocks
+// in bufs[]. The missing blocks are read together, so that runs of
+// adjacent block numbers can reach the disk as single requests.
 void
-bwrite(struct buf *b)
+bread_multi(uint dev, uint *blocknos, int n, struct buf **bufs)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  int i;
+
+  bplug();
+  for(i = 0; i < n; i++){
+    bufs[i] = bget(dev, blocknos[i]);
+    if(!bufs[i]->valid)
+      bstart(bufs[i], bufs[i]->blockno, 0, 0);
+  }
+  bunplug();
+  for(i = 0; i < n; i++){
+    if(!bufs[i]->valid){
+      bsync(bufs[i]);
+      bufs[i]->valid = 1;
+    } else if(bufs[i]->ra) {
+      __sync_fetch_and_add(&iostat.ra_hits, 1);
+    }
+    bufs[i]->ra = 0;
+  }
 }
 
-// Release a locked buffer.
-// Move to the head of the most-recently-used list.
-void
-brelse(struct buf *b)
+// Drop a reference to a locked buffer and unlock it.
+// Unlike brelse(), this may be called from an interrupt
+// handler on behalf of the process that locked b.
+static void
+bput(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
-
   int bucket = b->blockno % NBUCKET;
   acquire(&bcache_buckets[bucket].lock);
   b->refcnt--;
@@ -180,6 +284,214 @@ brelse(struct buf *b)
   release(&bcache_buckets[bucket].lock);
 }
 
+// Called by virtio_disk_intr() when a read-ahead finishes.
+static void
+bprefetch_done(struct buf *b)
+{
+  b->valid = 1;
+  __sync_fetch_and_sub(&bcache.ra_inflight, 1);
+  bput(b);
+}
+
+// Start reading the indicated block into the cache and
+// return without waiting for the disk. Does nothing if the
+// block is already cached, or if too many read-aheads are
+// already in flight to spare another buffer.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if(__sync_fetch_and_add(&bcache.ra_inflight, 0) >= NBUF/4)
+    return;
+
+  int bucket = blockno % NBUCKET;
+  acquire(&bcache_buckets[bucket].lock);
+  for(b = bcache_buckets[bucket].head.bnext; b != &bcache_buckets[bucket].head; b = b->bnext){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bcache_buckets[bucket].lock);
+      return;
+    }
+  }
+  b = brecycle(bucket, dev, blockno);
+  release(&bcache_buckets[bucket].lock);
+  if(b == 0)
+    return;
+
+  acquiresleep(&b->lock);
+  if(b->valid){
+    // someone else read it while we waited for the lock.
+    bput(b);
+    return;
+  }
+  b->ra = 1;
+  __sync_fetch_and_add(&bcache.ra_inflight, 1);
+  __sync_fetch_and_add(&iostat.ra_issued, 1);
+  bstart(b, b->blockno, 0, bprefetch_done);
+}
+
+// The log installs pinned bufs without locking them (see
+// bwrite_pinned()), so a write of locked buf b must wait for an
+// install of b to finish, and an install must wait for the
+// write: the two would share b's queue links.
+static void
+bwbegin(struct buf *b)
+{
+  struct spinlock *lk = &bcache_buckets[b->blockno % NBUCKET].lock;
+
+  acquire(lk);
+  while(b->installing)
+    sleep(&b->installing, lk);
+  b->writing = 1;
+  release(lk);
+}
+
+static void
+bwend(struct buf *b)
+{
+  struct spinlock *lk = &bcache_buckets[b->blockno % NBUCKET].lock;
+
+  acquire(lk);
+  b->writing = 0;
+  wakeup(&b->writing);
+  release(lk);
+}
+
+// Write b's contents to disk.  Must be locked.
+void
+bwrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite");
+  bwbegin(b);
+  bstart(b, b->blockno, 1, 0);
+  bsync(b);
+  bwend(b);
+}
+
+// Start writing b's contents to disk, but do not wait.
+// Must be locked, and stay locked until bwait(b).
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  bwbegin(b);
+  bstart(b, b->blockno, 1, 0);
+}
+
+// Write bufs[0..n) to the disk blocks in their ioblock, and
+// wait for all of them. bufs[] is sorted by disk block, so that
+// runs of adjacent blocks reach the disk as single requests.
+static void
+bwrite_batch(struct buf **bufs, int n)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 1; i < n; i++){
+    b = bufs[i];
+    for(j = i; j > 0 && bufs[j-1]->ioblock > b->ioblock; j--)
+      bufs[j] = bufs[j-1];
+    bufs[j] = b;
+  }
+
+  bplug();
+  for(i = 0; i < n; i++)
+    bstart(bufs[i], bufs[i]->ioblock, 1, 0);
+  bunplug();
+  for(i = 0; i < n; i++)
+    bsync(bufs[i]);
+}
+
+// Write the contents of n locked bufs to disk, and wait for
+// all of them. bufs[i] goes to disk block blocknos[i], or to its
+// own block if blocknos is 0. Sorts bufs[].
+void
+bwrite_multi(struct buf **bufs, uint *blocknos, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwrite_multi");
+    bufs[i]->ioblock = blocknos ? blocknos[i] : bufs[i]->blockno;
+  }
+  bwrite_batch(bufs, n);
+}
+
+// Write n pinned bufs to their own disk blocks without locking
+// them, and wait. Used by the log to install blocks, which may
+// change while they are written; the log makes that safe. The
+// only other I/O on a pinned, valid buf is a bwrite() of it,
+// which bwbegin() keeps apart from this. Sorts bufs[].
+void
+bwrite_pinned(struct buf **bufs, int n)
+{
+  struct spinlock *lk;
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(bufs[i]->refcnt < 1 || !bufs[i]->valid)
+      panic("bwrite_pinned");
+    lk = &bcache_buckets[bufs[i]->blockno % NBUCKET].lock;
+    acquire(lk);
+    while(bufs[i]->writing)
+      sleep(&bufs[i]->writing, lk);
+    bufs[i]->installing = 1;
+    release(lk);
+    bufs[i]->ioblock = bufs[i]->blockno;
+  }
+  bwrite_batch(bufs, n);
+  for(i = 0; i < n; i++){
+    lk = &bcache_buckets[bufs[i]->blockno % NBUCKET].lock;
+    acquire(lk);
+    bufs[i]->installing = 0;
+    wakeup(&bufs[i]->installing);
+    release(lk);
+  }
+}
+
+// Wait for the write started by bwrite_async(b).
+void
+bwait(struct buf *b)
+{
+  bsync(b);
+  bwend(b);
+}
+
+// Between bplug() and bunplug(), I/O the calling process starts
+// is held back, so that the whole batch reaches the I/O scheduler
+// together, where it can be sorted and merged, and the device gets
+// a single notification. Waiting for a buffer still sends
+// everything held back so far.
+void
+bplug(void)
+{
+  myproc()->plugged++;
+}
+
+void
+bunplug(void)
+{
+  struct proc *p = myproc();
+
+  if(p->plugged < 1)
+    panic("bunplug");
+  if(--p->plugged == 0)
+    bflush();
+}
+
+// Release a locked buffer.
+void
+brelse(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("brelse");
+
+  bput(b);
+}
+
 void
 bpin(struct buf *b) {
   int bucket = b->blockno % NBUCKET;
@@ -1,12 +1,25 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int ra;      // read ahead and not yet used?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *bnext; // disk queue
+  struct buf *bnext; // hash bucket list
   struct buf *bprev;
+  struct buf *qnext; // disk queue
+  struct buf *ionext; // next block of the same disk request
+  uint ioblock;      // disk block of the queued operation
+  int iowrite;       // queued operation is a write?
+  void (*iodone)(struct buf *); // called when the disk is done, or 0
+  int iopid;         // process that queued the operation
+  int iovq;          // virtqueue it went to
+  uint64 iotime;     // when it was queued, in r_time() cycles
+  uint logseq;       // last log transaction to log_write() it
+  uint dataseq;      // last log transaction to log_data() it
+  int installing;    // the log is writing it home, unlocked
+  int writing;       // a bwrite() of it is in progress
   #ifdef LAB_MMAP
   uchar *data;
   #else
@@ -4,8 +4,11 @@ typedef long int off_t;
 #endif
 struct buf;
 struct context;
+struct dirblk;
 struct file;
 struct inode;
+struct iostat;
+struct ioqueue;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -20,36 +23,56 @@ struct sock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+void            bplug(void);
+void            bunplug(void);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
-#ifdef LAB_MMAP
+void            bprefetch(uint, uint);
+void            bread_multi(uint, uint*, int, struct buf**);
+void            bwrite_multi(struct buf**, uint*, int);
+void            bwrite_pinned(struct buf**, int);
+extern struct iostat iostat;
 struct buf*     bget(uint, uint);
-#endif
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// elevator.c
+void            elv_add(struct ioqueue*, struct buf*);
+struct buf*     elv_next(struct ioqueue*, int);
+void            elv_done(struct buf*);
+int             elv_sched(int);
+
 // exec.c
 int             exec(char*, char**);
 
 // file.c
 struct file*    filealloc(void);
-void            fileclose(struct file*);
+int             fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             fileadvise(struct file*, uint, uint, int);
+int             filesync(struct file*);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+int             dirnext(struct inode*, struct dirblk*);
+void            dirdone(struct dirblk*);
+int             getdents(struct inode*, uint64, uint*, int);
+void            dcenter(struct inode*, char*, uint, uint);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
@@ -59,14 +82,18 @@ void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
+struct inode*   nameiat(struct inode*, char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
-#ifdef LAB_MMAP
+int             iinline(struct inode*);
 uint            bmap(struct inode*, uint);
-#endif
+int             idelayed(struct inode*, uint);
+int             iflush(struct inode*);
+void            iflushall(void);
+int             delalloc(int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -88,7 +115,16 @@ void            kalloc_cow(void *pa);
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_op_n(int);
 void            end_op(void);
+void            log_tick(void);
+uint            log_seq(void);
+void            log_force(uint);
+int             log_async(int);
+void            log_data(struct buf*);
+int             log_ordered(int);
+int             log_ordered_op(void);
+int             log_fixedrsv(int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -123,6 +159,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -219,8 +256,11 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_submit(struct buf *, int, void (*)(struct buf *));
+void            virtio_disk_kick(uint);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+int             virtio_disk_poll(int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
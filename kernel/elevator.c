@@ -0,0 +1,188 @@
+//
+// Block I/O scheduler.
+//
+// Buffers handed to virtio_disk_submit() wait in a struct ioqueue
+// until the driver has room for another request. The scheduler
+// picks the request to start next, and merges queued buffers for
+// adjacent blocks into it, so that one request can move many blocks.
+//
+// IOSCHED_NOOP starts requests in the order they arrived.
+//
+// IOSCHED_DEADLINE sweeps the disk in one direction (C-LOOK):
+// it starts the lowest-numbered block at or after the end of the
+// previous request, wrapping around to the lowest block. A request
+// that has waited longer than its deadline goes first, so a busy
+// region of the disk cannot starve the rest, and a process that has
+// had ELV_QUANTUM requests started in a row gives way to the others.
+//
+// The caller provides the locking for each queue.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "proc.h"
+#include "elevator.h"
+#include "iostat.h"
+
+#define READ_EXPIRE  (CLINT_FREQ / 20)  // reads wait at most 50 ms
+#define WRITE_EXPIRE (CLINT_FREQ / 2)   // writes wait at most 500 ms
+#define ELV_QUANTUM  8  // requests in a row for one process
+
+static int iosched = IOSCHED_DEADLINE;
+
+// Add locked buffer b, with b->iowrite and b->iodone set,
+// to the tail of q.
+void
+elv_add(struct ioqueue *q, struct buf *b)
+{
+  struct proc *p = myproc();
+
+  b->iotime = r_time();
+  b->iopid = p ? p->pid : 0;
+  b->qnext = 0;
+  if(q->tail)
+    q->tail->qnext = b;
+  else
+    q->head = b;
+  q->tail = b;
+}
+
+static void
+elv_remove(struct ioqueue *q, struct buf *b)
+{
+  struct buf **pp, *prev = 0;
+
+  for(pp = &q->head; *pp != b; pp = &(*pp)->qnext)
+    prev = *pp;
+  *pp = b->qnext;
+  if(q->tail == b)
+    q->tail = prev;
+  b->qnext = 0;
+}
+
+// Find a queued buffer that can join a request
+// for blocks of dev in direction write.
+static struct buf*
+elv_find(struct ioqueue *q, uint dev, uint block, int write)
+{
+  struct buf *b;
+
+  for(b = q->head; b; b = b->qnext)
+    if(b->dev == dev && b->ioblock == block && b->iowrite == write)
+      return b;
+  return 0;
+}
+
+// C-LOOK: the lowest block at or after q->pos, or failing that
+// the lowest block, among requests not queued by process skip.
+static struct buf*
+elv_clook(struct ioqueue *q, int skip)
+{
+  struct buf *b, *ahead = 0, *wrap = 0;
+
+  for(b = q->head; b; b = b->qnext){
+    if(b->iopid == skip)
+      continue;
+    if(b->ioblock >= q->pos){
+      if(ahead == 0 || b->ioblock < ahead->ioblock)
+        ahead = b;
+    } else if(wrap == 0 || b->ioblock < wrap->ioblock){
+      wrap = b;
+    }
+  }
+  return ahead ? ahead : wrap;
+}
+
+static struct buf*
+elv_deadline(struct ioqueue *q)
+{
+  struct buf *b = q->head;
+  uint64 expire = b->iowrite ? WRITE_EXPIRE : READ_EXPIRE;
+
+  // the head of the queue is the oldest request.
+  if(r_time() - b->iotime > expire)
+    return b;
+
+  if(q->batch >= ELV_QUANTUM && (b = elv_clook(q, q->lastpid)) != 0)
+    return b;
+  return elv_clook(q, -1);
+}
+
+// Remove the next request to start from q, with up to max
+// buffers for adjacent blocks linked through ionext in
+// block order. Returns 0 if q is empty.
+struct buf*
+elv_next(struct ioqueue *q, int max)
+{
+  struct buf *first, *last, *b;
+  int n;
+
+  if(q->head == 0)
+    return 0;
+
+  if(iosched == IOSCHED_NOOP)
+    first = q->head;
+  else
+    first = elv_deadline(q);
+  elv_remove(q, first);
+  first->ionext = 0;
+  last = first;
+
+  // merge queued buffers for the blocks after and before.
+  for(n = 1; n < max; n++){
+    if((b = elv_find(q, first->dev, last->ioblock + 1, first->iowrite)) != 0){
+      last->ionext = b;
+      last = b;
+    } else if(first->ioblock > 0 &&
+              (b = elv_find(q, first->dev, first->ioblock - 1, first->iowrite)) != 0){
+      b->ionext = first;
+      first = b;
+    } else {
+      break;
+    }
+    elv_remove(q, b);
+  }
+  last->ionext = 0;
+
+  q->pos = last->ioblock + 1;
+  if(first->iopid == q->lastpid){
+    q->batch++;
+  } else {
+    q->lastpid = first->iopid;
+    q->batch = 1;
+  }
+  return first;
+}
+
+// Account for the completion of the I/O on b.
+void
+elv_done(struct buf *b)
+{
+  uint64 us = (r_time() - b->iotime) / (CLINT_FREQ / 1000000);
+  int i;
+
+  for(i = 0; i < NIOLAT-1 && (1UL << i) <= us; i++)
+    ;
+  __sync_fetch_and_add(&iostat.lat[i], 1);
+}
+
+// Select the I/O scheduler, if sched >= 0.
+// Returns the previous one, or -1 if sched is not valid.
+int
+elv_sched(int sched)
+{
+  int old = iosched;
+
+  if(sched == IOSCHED_NOOP || sched == IOSCHED_DEADLINE)
+    iosched = sched;
+  else if(sched >= 0)
+    return -1;
+  return old;
+}
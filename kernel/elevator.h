@@ -0,0 +1,9 @@
+// Queue of block I/O waiting for the disk,
+// ordered by the I/O scheduler (see elevator.c).
+struct ioqueue {
+  struct buf *head;  // queued buffers in arrival order, linked by qnext
+  struct buf *tail;
+  uint pos;          // block after the last dispatched request
+  int lastpid;       // process whose requests were dispatched last
+  int batch;         // how many of them in a row
+};
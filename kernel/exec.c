@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -31,7 +32,7 @@ exec(char *path, char **argv)
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
-  begin_op();
+  begin_op_n(LOG_LOOKUP + LOG_IPUT);
 
   if((ip = namei(path)) == 0){
     end_op();
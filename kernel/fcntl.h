@@ -7,6 +7,12 @@
 #define O_NOFOLLOW 0x800
 #endif
 
+// fadvise() hints
+#define FADV_NORMAL     0
+#define FADV_RANDOM     1
+#define FADV_SEQUENTIAL 2
+#define FADV_WILLNEED   3
+
 #ifdef LAB_MMAP
 #define PROT_NONE       0x0
 #define PROT_READ       0x1
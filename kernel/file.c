@@ -12,6 +12,7 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "fcntl.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -56,17 +57,19 @@ filedup(struct file *f)
 }
 
 // Close file f.  (Decrement ref count, close when reaches 0.)
-void
+// Returns -1 if the file's delayed blocks didn't fit on disk.
+int
 fileclose(struct file *f)
 {
   struct file ff;
+  int r = 0;
 
   acquire(&ftable.lock);
   if(f->ref < 1)
     panic("fileclose");
   if(--f->ref > 0){
     release(&ftable.lock);
-    return;
+    return 0;
   }
   ff = *f;
   f->ref = 0;
@@ -76,10 +79,13 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    if(ff.type == FD_INODE && ff.writable)
+      r = iflush(ff.ip);
+    begin_op_n(LOG_IPUT);
     iput(ff.ip);
     end_op();
   }
+  return r;
 }
 
 // Get metadata about file f.
@@ -101,6 +107,114 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Issue read-ahead for a reader of f that has just read
+// blocks first..last. Sequential readers get a window of
+// upcoming blocks started asynchronously, doubling in size
+// each time the reader catches up with it, so that their
+// later bread()s find the blocks already cached.
+// Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, uint first, uint last)
+{
+  struct inode *ip = f->ip;
+  struct readahead *ra = &f->ra;
+  uint bn, end, nblocks, addr;
+
+  if(ra->advice == FADV_RANDOM)
+    return;
+
+  if(first != ra->prev && first != ra->prev + 1 && ra->advice != FADV_SEQUENTIAL){
+    // random access: drop the window.
+    ra->prev = last;
+    ra->next = last + 1;
+    ra->window = 0;
+    return;
+  }
+  ra->prev = last;
+  if(ra->next <= last)
+    ra->next = last + 1;
+
+  // still at least half a window ahead of the reader?
+  if(ra->window != 0 && ra->next > last + ra->window/2)
+    return;
+
+  if(ra->window == 0)
+    ra->window = (ra->advice == FADV_SEQUENTIAL) ? MAXRABLOCKS : 4;
+  else if(ra->window < MAXRABLOCKS)
+    ra->window *= 2;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = last + 1 + ra->window;
+  if(end > nblocks)
+    end = nblocks;
+  bplug();
+  for(bn = ra->next; bn < end; bn++){
+    if(idelayed(ip, bn) || (addr = bmap(ip, bn)) == 0)
+      break;
+    bprefetch(ip->dev, addr);
+  }
+  bunplug();
+  ra->next = bn;
+}
+
+// Apply an fadvise() hint for len bytes at offset off of f.
+int
+fileadvise(struct file *f, uint off, uint len, int advice)
+{
+  struct inode *ip = f->ip;
+  uint bn, end, addr;
+
+  if(f->type != FD_INODE)
+    return -1;
+
+  switch(advice){
+  case FADV_NORMAL:
+  case FADV_RANDOM:
+  case FADV_SEQUENTIAL:
+    ilock(ip);
+    f->ra.advice = advice;
+    f->ra.window = 0;
+    iunlock(ip);
+    return 0;
+  case FADV_WILLNEED:
+    ilock(ip);
+    if(off < ip->size && !iinline(ip)){  // an inline file is in its i-node
+      if(len == 0 || len > ip->size - off)
+        len = ip->size - off;
+      end = (off + len + BSIZE - 1) / BSIZE;
+      if(end - off / BSIZE > NBUF/4)
+        end = off / BSIZE + NBUF/4;  // more would not stay cached
+      bplug();
+      for(bn = off / BSIZE; bn < end; bn++){
+        if(idelayed(ip, bn) || (addr = bmap(ip, bn)) == 0)
+          break;
+        bprefetch(ip->dev, addr);
+      }
+      bunplug();
+    }
+    iunlock(ip);
+    return 0;
+  }
+  return -1;
+}
+
+// Wait until the changes to f's inode are on disk.
+int
+filesync(struct file *f)
+{
+  uint seq;
+
+  if(f->type != FD_INODE && f->type != FD_DEVICE)
+    return -1;
+  if(f->type == FD_INODE && iflush(f->ip) < 0)
+    return -1;
+  ilock(f->ip);
+  seq = f->ip->logseq;
+  iunlock(f->ip);
+  log_force(seq);
+  return 0;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -119,8 +233,10 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
+      readahead(f, f->off / BSIZE, (f->off + r - 1) / BSIZE);
       f->off += r;
+    }
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -150,16 +266,37 @@ filewrite(struct file *f, uint64 addr, int n)
     // the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
+    // in ordered mode the data blocks are not logged,
+    // so only the others count.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max, nblocks, ordered, flush = 0;
     int i = 0;
     while(i < n){
       int n1 = n - i;
+
+      ordered = log_ordered_op();
+      if(ordered)
+        max = MAXOPDATA * BSIZE;
+      else
+        max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
       if(n1 > max)
         n1 = max;
-
-      begin_op();
+      nblocks = n1/BSIZE + 1;
+      begin_op_n(1 + 2*NLEVEL + BITMAPS(nblocks + 2*NLEVEL) +
+                 (ordered ? 0 : nblocks + flush));
+      if(log_ordered_op() != ordered){
+        // joined a transaction of the other mode.
+        end_op();
+        continue;
+      }
+      if(!ordered && !flush && atomic_read4(&f->ip->ndelay) > 0){
+        // blocks delayed in ordered mode, which writei() will
+        // write through the log first.
+        end_op();
+        flush = LOG_FLUSH;
+        continue;
+      }
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -1,3 +1,11 @@
+// read-ahead state of an open file.
+struct readahead {
+  int advice;        // FADV_* hint from fadvise()
+  uint prev;         // last block read through this file
+  uint next;         // first block not yet read ahead
+  uint window;       // current read-ahead window, in blocks
+};
+
 struct file {
 #ifdef LAB_NET
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_SOCK } type;
@@ -13,6 +21,7 @@ struct file {
   struct sock *sock; // FD_SOCK
 #endif
   uint off;          // FD_INODE
+  struct readahead ra; // FD_INODE
   short major;       // FD_DEVICE
 };
 
@@ -25,8 +34,20 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // hash bucket chain, or free list
+  struct inode *lnext; // LRU list of unused entries
+  struct inode *lprev;
+  int onlru;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint logseq;        // last log transaction that may have changed it
+  struct extent ehint; // extent bmap() last found, if FS_EXTENTS
+  uint pastart;       // blocks writei() allocated for bmap() to use
+  int palen;
+  uint dblock;        // file block of delay[0]
+  int ndelay;         // blocks at the end of the file not yet on disk
+  int resv;           // reserved blocks dalloc() may allocate from
+  char *delay[NDELAY]; // their data, a page each
 
   short type;         // copy of disk inode
   short major;
@@ -40,6 +61,14 @@ struct inode {
   #endif
 };
 
+// a directory block being scanned by dirnext().
+struct dirblk {
+  uint off;           // offset of de[0] in the directory
+  int n;              // dirents at de
+  struct dirent *de;  // in bp->data
+  struct buf *bp;
+};
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
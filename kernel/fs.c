@@ -37,6 +37,10 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void fmapinit(int dev);
+static void imapinit(int dev);
+static void dcinit(void);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,47 +48,260 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  fmapinit(dev);
+  imapinit(dev);
 }
 
-// Zero a block.
+// Zero a block. A block of file data goes through log_data().
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// Free blocks are found through block groups, each with one
+// bitmap block; without FS_GROUPS, the blocks each bitmap block
+// describes act as a group. The free map summary, built at
+// mount, counts each group's free blocks, so allocation skips
+// full groups without reading their bitmaps. Allocation within
+// a group is next-fit: it goes on from where the group's last
+// one ended, at its cursor, unless asked for a particular block.
+// A group's bitmap buffer lock serializes allocation in it, so
+// allocations in different groups proceed in parallel; its
+// spinlock protects its count and cursor. Blocks reserved for
+// files' delayed blocks (see dalloc()) count as free in the
+// groups, but allocation leaves that many free.
+struct group {
+  struct spinlock lock;
+  int nfree;            // free blocks
+  int cursor;           // bit after the last allocated run
+};
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+struct {
+  int n;                // number of groups
+  int last;             // group of the last allocation
+  struct spinlock lock; // protects reserved
+  int reserved;         // free blocks set aside for delayed blocks,
+                        // or claimed by a ballocn() in progress
+  struct group group[NBITMAP];
+} fmap;
+
+// First block of group g.
 static uint
-balloc(uint dev)
+gbase(int g)
+{
+  return sb.features & FS_GROUPS ? GSTART(g, sb) : g * BPB;
+}
+
+// Number of blocks in group g.
+static int
+gbits(int g)
+{
+  return min(sb.features & FS_GROUPS ? sb.bpg : BPB, sb.size - gbase(g));
+}
+
+static int
+popcount(uint64 x)
+{
+  int n;
+
+  for(n = 0; x; n++)
+    x &= x - 1;
+  return n;
+}
+
+static void
+fmapinit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint64 *w;
+  int g, i, nbits, used;
+
+  if(sb.features & FS_GROUPS)
+    fmap.n = sb.ngroups;
+  else
+    fmap.n = (sb.size + BPB - 1) / BPB;
+  if(fmap.n > NBITMAP)
+    panic("fmapinit: too many groups");
+  initlock(&fmap.lock, "fmapresv");
+  for(g = 0; g < fmap.n; g++){
+    initlock(&fmap.group[g].lock, "fmap");
+    bp = bread(dev, BBLOCK(gbase(g), sb));
+    w = (uint64*)bp->data;
+    nbits = gbits(g);
+    used = 0;
+    for(i = 0; i + 64 <= nbits; i += 64)
+      used += popcount(w[i/64]);
+    for(; i < nbits; i++)
+      used += (bp->data[i/8] >> (i%8)) & 1;
+    brelse(bp);
+    fmap.group[g].nfree = nbits - used;
+    fmap.group[g].cursor = 0;
+  }
+  fmap.last = 0;
+}
+
+// Free blocks not reserved for delayed blocks.
+static int
+bavail(void)
+{
+  int g, n;
+
+  n = -atomic_read4(&fmap.reserved);
+  for(g = 0; g < fmap.n; g++)
+    n += atomic_read4(&fmap.group[g].nfree);
+  return n;
+}
+
+// Reserve n free blocks for delayed blocks, or release -n of
+// them if n is negative. Returns -1 if there aren't n.
+static int
+breserve(int n)
+{
+  acquire(&fmap.lock);
+  if(n > 0 && bavail() < n){
+    release(&fmap.lock);
+    return -1;
+  }
+  fmap.reserved += n;
+  release(&fmap.lock);
+  return 0;
+}
+
+// First free bit at or after bit i of bitmap block data,
+// of the first nbits, or -1. Skips full 64-bit words.
+static int
+bscan(uchar *data, int i, int nbits)
+{
+  uint64 *w = (uint64*)data;
+
+  while(i < nbits){
+    if(i % 64 == 0 && w[i/64] == ~0UL){
+      i += 64;
+      continue;
+    }
+    if((data[i/8] & (1 << (i%8))) == 0)
+      return i;
+    i++;
+  }
+  return -1;
+}
+
+// Allocate up to n disk blocks in a row for ip, starting at goal
+// if it is free, and otherwise at the next free block in goal's
+// group, or in the group of the last allocation if goal is 0, or
+// in the groups after. Draws first on ip->resv, the blocks
+// reserved for ip's delayed blocks, and leaves everyone else's
+// reservations free. Sets *got to how many, and returns the
+// first, or 0 if out of disk space. The blocks are not zeroed:
+// the caller must fill them in the same transaction, before
+// anything can read them.
+static uint
+ballocn(struct inode *ip, uint goal, int n, int *got)
+{
+  struct buf *bp;
+  int g0, g, k, i, run, cursor, take, back, avail;
+
+  // claim the n blocks, as a reservation of their own, so that
+  // neither breserve() nor another ballocn() can take them.
+  *got = 0;
+  acquire(&fmap.lock);
+  take = min(n, ip->resv);
+  avail = bavail();
+  if(n > take + avail)
+    n = take + avail;
+  if(n <= 0){
+    release(&fmap.lock);
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  ip->resv -= take;
+  fmap.reserved += n - take;
+  release(&fmap.lock);
 
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+  i = -1;
+  if(goal > 0 && goal >= gbase(0) && goal < sb.size){
+    g0 = g = BGROUP(goal, sb);
+    if(atomic_read4(&fmap.group[g].nfree) > 0){
+      bp = bread(ip->dev, BBLOCK(goal, sb));
+      i = goal - gbase(g);
+      if(bp->data[i/8] & (1 << (i%8))){
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        i = -1;
       }
     }
+  } else {
+    g0 = atomic_read4(&fmap.last);
+  }
+  if(i < 0){
+    for(k = 0; k < fmap.n; k++){
+      g = (g0 + k) % fmap.n;
+      if(atomic_read4(&fmap.group[g].nfree) == 0)
+        continue;
+      cursor = atomic_read4(&fmap.group[g].cursor);
+      bp = bread(ip->dev, BBLOCK(gbase(g), sb));
+      if((i = bscan(bp->data, cursor, gbits(g))) >= 0 ||
+         (i = bscan(bp->data, 0, cursor)) >= 0)
+        break;
+      brelse(bp);
+    }
+  }
+
+  // Take the run of free blocks at i, up to n of them.
+  run = 0;
+  if(i >= 0){
+    for(; run < n && i + run < gbits(g); run++){
+      if(bp->data[(i+run)/8] & (1 << ((i+run)%8)))
+        break;
+      bp->data[(i+run)/8] |= 1 << ((i+run)%8);  // Mark block in use.
+    }
+    log_write(bp);
+    acquire(&fmap.group[g].lock);
+    fmap.group[g].nfree -= run;
+    fmap.group[g].cursor = i + run;
+    release(&fmap.group[g].lock);
+    fmap.last = g;
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
-  return 0;
+
+  // drop the claim, giving back what's left of ip's part.
+  acquire(&fmap.lock);
+  back = min(take, n - run);
+  fmap.reserved -= n - back;
+  ip->resv += back;
+  release(&fmap.lock);
+
+  if(run == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  *got = run;
+  return gbase(g) + i;
+}
+
+// Allocate a zeroed disk block for ip, for file data if data
+// is set, at goal if it is free.
+// returns 0 if out of disk space.
+static uint
+balloc(struct inode *ip, uint goal, int data)
+{
+  uint b;
+  int got;
+
+  if((b = ballocn(ip, goal, 1, &got)) != 0)
+    bzero(ip->dev, b, data);
+  return b;
 }
 
 // Free a disk block.
@@ -92,15 +309,19 @@ static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
-  int bi, m;
+  int g, bi, m;
 
+  g = BGROUP(b, sb);
   bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
+  bi = b - gbase(g);
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&fmap.group[g].lock);
+  fmap.group[g].nfree++;
+  release(&fmap.group[g].lock);
   brelse(bp);
 }
 
@@ -130,11 +351,13 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   is unused if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. An unused entry stays in the table,
+//   so that iget() can find it again, until iget() needs
+//   it for another i-node.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -164,55 +387,333 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table of i-nodes keyed by (dev, inum),
+// with a spin-lock per bucket. A bucket's lock protects the
+// hnext links of its entries, and changes to their dev and inum.
+// ip->ref is changed atomically, but it only rises from zero, or
+// falls to zero, with ip's bucket locked.
+//
+// The table starts with NINODE entries. Unused ones are kept on
+// an LRU list, and iget() reuses the least recently used; an
+// entry on the list that turns out to be in use again is just
+// dropped from it. If every entry is in use, iget() allocates
+// more, a page of them at a time, and iput() frees them again
+// as soon as they fall out of use. itable.lock protects the LRU
+// list and the free extra entries, and is taken after a bucket
+// lock if both are held.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum and the links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+struct ipage {
+  int nused;                      // entries allocated from this page
+  struct inode inode[];
+};
+
+#define IPERPAGE ((PGSIZE - sizeof(struct ipage)) / sizeof(struct inode))
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode lru;               // lru.lnext is the most recently used
+  struct inode *free;             // extra entries not in use
+  int nextra;                     // extra entries allocated
 } itable;
 
+struct {
+  struct spinlock lock;
+  struct inode *head;
+} itable_buckets[NIBUCKET];
+
+static int
+ibucket(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIBUCKET;
+}
+
+// Add ip to the front of the LRU list, or move it there.
+// Caller must hold itable.lock.
+static void
+lru_touch(struct inode *ip)
+{
+  if(ip->onlru){
+    ip->lnext->lprev = ip->lprev;
+    ip->lprev->lnext = ip->lnext;
+  }
+  ip->lnext = itable.lru.lnext;
+  ip->lprev = &itable.lru;
+  itable.lru.lnext->lprev = ip;
+  itable.lru.lnext = ip;
+  ip->onlru = 1;
+}
+
+// Take ip off the LRU list. Caller must hold itable.lock.
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  ip->onlru = 0;
+}
+
+// Remove ip from bucket h. Caller must hold h's lock.
+static void
+unhash(int h, struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable_buckets[h].head; *pp != ip; pp = &(*pp)->hnext)
+    if(*pp == 0)
+      panic("unhash");
+  *pp = ip->hnext;
+  ip->hnext = 0;
+  ip->inum = 0;
+}
+
+static int
+isextra(struct inode *ip)
+{
+  return ip < &itable.inode[0] || ip >= &itable.inode[NINODE];
+}
+
+// Return an unused entry, not in any bucket, to the table.
+static void
+ifree(struct inode *ip)
+{
+  struct ipage *pg;
+  struct inode **pp;
+
+  acquire(&itable.lock);
+  if(!isextra(ip)){
+    // reuse it before any entry still holding an i-node
+    if(ip->onlru)
+      lru_remove(ip);
+    ip->lprev = itable.lru.lprev;
+    ip->lnext = &itable.lru;
+    itable.lru.lprev->lnext = ip;
+    itable.lru.lprev = ip;
+    ip->onlru = 1;
+    release(&itable.lock);
+    return;
+  }
+  pg = (struct ipage*)PGROUNDDOWN((uint64)ip);
+  if(--pg->nused > 0){
+    ip->hnext = itable.free;
+    itable.free = ip;
+    release(&itable.lock);
+    return;
+  }
+  for(pp = &itable.free; *pp; ){
+    if(PGROUNDDOWN((uint64)*pp) == (uint64)pg)
+      *pp = (*pp)->hnext;
+    else
+      pp = &(*pp)->hnext;
+  }
+  itable.nextra -= IPERPAGE;
+  release(&itable.lock);
+  kfree(pg);
+}
+
+// Find an unused entry for iget(): the least recently used
+// one, or else a new one. Returns it out of any bucket.
+static struct inode*
+inew(void)
+{
+  struct inode *ip;
+  struct ipage *pg;
+  int h, i;
+
+  for(;;){
+    acquire(&itable.lock);
+    ip = itable.lru.lprev;
+    if(ip == &itable.lru){
+      release(&itable.lock);
+      break;
+    }
+    lru_remove(ip);
+    release(&itable.lock);
+    if(ip->inum == 0)
+      return ip;
+    h = ibucket(ip->dev, ip->inum);
+    acquire(&itable_buckets[h].lock);
+    if(ip->ref == 0){
+      acquire(&itable.lock);
+      if(ip->onlru)
+        lru_remove(ip);
+      release(&itable.lock);
+      unhash(h, ip);
+      release(&itable_buckets[h].lock);
+      return ip;
+    }
+    release(&itable_buckets[h].lock);
+  }
+
+  // Every entry is in use.
+  acquire(&itable.lock);
+  if(itable.free == 0){
+    if((pg = (struct ipage*)kalloc()) == 0)
+      panic("iget: no inodes");
+    memset(pg, 0, PGSIZE);
+    for(i = 0; i < IPERPAGE; i++){
+      initsleeplock(&pg->inode[i].lock, "inode");
+      pg->inode[i].hnext = itable.free;
+      itable.free = &pg->inode[i];
+    }
+    itable.nextra += IPERPAGE;
+  }
+  ip = itable.free;
+  itable.free = ip->hnext;
+  ip->hnext = 0;
+  ((struct ipage*)PGROUNDDOWN((uint64)ip))->nused++;
+  release(&itable.lock);
+  return ip;
+}
+
 void
 iinit()
 {
   int i = 0;
 
+  dcinit();
   initlock(&itable.lock, "itable");
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&itable_buckets[i].lock, "itable bucket");
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    lru_touch(&itable.inode[i]);
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcpurge(uint dev, uint dir);
+static int dalloc(struct inode *ip);
+
+// The free i-node map, built at mount, has a bit per on-disk
+// i-node, set if it is allocated, and counts each block group's
+// free i-nodes, so ialloc() goes straight to a free one without
+// reading i-node blocks. ialloc() sets an i-node's bit before
+// marking it allocated on disk, and iput() clears it after
+// freeing it there.
+struct {
+  struct spinlock lock;
+  uchar *used;          // a bit per i-node
+  int nfree[NBITMAP];   // free i-nodes per group
+  int ng;               // groups
+  int ipg;              // i-nodes per group
+} imap;
+
+static void
+imapinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  int inum;
+
+  initlock(&imap.lock, "imap");
+  if(sb.features & FS_GROUPS){
+    imap.ng = sb.ngroups;
+    imap.ipg = sb.ipg;
+  } else {
+    imap.ng = 1;
+    imap.ipg = sb.ninodes;
+  }
+  if(sb.ninodes > PGSIZE*8 || (imap.used = kalloc()) == 0)
+    panic("imapinit");
+  memset(imap.used, 0, PGSIZE);
+  bp = 0;
+  for(inum = 0; inum < sb.ninodes; inum++){
+    if(bp == 0 || inum % IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(inum == 0 || dip->type != 0)
+      imap.used[inum/8] |= 1 << (inum%8);
+    else
+      imap.nfree[inum / imap.ipg]++;
+  }
+  brelse(bp);
+}
+
+// Take a free i-node of group g from the map, the first at or
+// after start, or else the first in the group. Returns 0 if
+// the group has none.
+static int
+imaptake(int g, int start)
+{
+  int first, end, i;
+
+  first = g * imap.ipg;
+  end = first + imap.ipg;
+  acquire(&imap.lock);
+  if(imap.nfree[g] == 0){
+    release(&imap.lock);
+    return 0;
+  }
+  if(start < first || start >= end)
+    start = first;
+  if((i = bscan(imap.used, start, end)) < 0)
+    i = bscan(imap.used, first, start);
+  if(i < 0)
+    panic("imaptake");
+  imap.used[i/8] |= 1 << (i%8);
+  imap.nfree[g]--;
+  release(&imap.lock);
+  return i;
+}
+
+// Return i-node inum, freed on disk, to the map.
+static void
+imapput(int inum)
+{
+  acquire(&imap.lock);
+  if((imap.used[inum/8] & (1 << (inum%8))) == 0)
+    panic("imapput");
+  imap.used[inum/8] &= ~(1 << (inum%8));
+  imap.nfree[inum / imap.ipg]++;
+  release(&imap.lock);
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// A file goes in the block group of its parent directory,
+// parent, near it in the i-node table, so that it likely
+// shares an i-node block with its siblings. A directory goes
+// in the group with the most free blocks, so that unrelated
+// trees spread over the disk.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint parent)
 {
-  int inum;
+  int inum, g0, g, k;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  g0 = parent / imap.ipg;
+  if(type == T_DIR){
+    for(g = 0; g < imap.ng; g++)
+      if(atomic_read4(&fmap.group[g].nfree) > atomic_read4(&fmap.group[g0].nfree) &&
+         atomic_read4(&imap.nfree[g]) > 0)
+        g0 = g;
+  }
+
+  for(k = 0; k < imap.ng; k++){
+    g = (g0 + k) % imap.ng;
+    if((inum = imaptake(g, g == g0 ? parent - parent % IPB : 0)) == 0)
+      continue;
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
+    if(dip->type != 0)
+      panic("ialloc: free map");
+    memset(dip, 0, sizeof(*dip));
+    dip->type = type;
+    log_write(bp);   // mark it allocated on the disk
     brelse(bp);
+    return iget(dev, inum);
   }
   printf("ialloc: no inodes\n");
   return 0;
@@ -234,10 +735,12 @@ iupdate(struct inode *ip)
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
+  // on disk, the file ends before its delayed blocks.
+  dip->size = ip->ndelay > 0 ? min(ip->size, ip->dblock * BSIZE) : ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->logseq = log_seq();
 }
 
 // Find the inode with number inum on device dev
@@ -246,32 +749,37 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct inode *ip, *new;
+  int h = ibucket(dev, inum);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  new = 0;
+  for(;;){
+    acquire(&itable_buckets[h].lock);
+    for(ip = itable_buckets[h].head; ip; ip = ip->hnext){
+      if(ip->dev == dev && ip->inum == inum){
+        __sync_fetch_and_add(&ip->ref, 1);
+        release(&itable_buckets[h].lock);
+        if(new)
+          ifree(new);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    if(new)
+      break;
+    release(&itable_buckets[h].lock);
+    new = inew();
   }
 
   // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = new;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  ip->hnext = itable_buckets[h].head;
+  itable_buckets[h].head = ip;
+  release(&itable_buckets[h].lock);
 
   return ip;
 }
@@ -281,9 +789,7 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
-  ip->ref++;
-  release(&itable.lock);
+  __sync_fetch_and_add(&ip->ref, 1);
   return ip;
 }
 
@@ -310,6 +816,8 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ehint.len = 0;
+    ip->logseq = log_seq(); // its last change may not be durable yet
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -336,7 +844,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int h = ibucket(ip->dev, ip->inum);
+
+  acquire(&itable_buckets[h].lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +855,42 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&itable_buckets[h].lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    imapput(ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&itable_buckets[h].lock);
+  } else if(ip->ref == 1 && ip->valid && ip->ndelay > 0){
+    // fileclose() writes a file's delayed blocks, so this
+    // shouldn't happen; but the entry mustn't be recycled
+    // with them.
+    acquiresleep(&ip->lock);
+    release(&itable_buckets[h].lock);
+    dalloc(ip);
+    releasesleep(&ip->lock);
+    acquire(&itable_buckets[h].lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(__sync_sub_and_fetch(&ip->ref, 1) == 0){
+    if(isextra(ip)){
+      unhash(h, ip);
+      release(&itable_buckets[h].lock);
+      ifree(ip);
+      return;
+    }
+    acquire(&itable.lock);
+    lru_touch(ip);
+    release(&itable.lock);
+  }
+  release(&itable_buckets[h].lock);
 }
 
 // Common idiom: unlock, then put.
@@ -375,6 +907,145 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// If the file system has FS_EXTENTS, ip->addrs[] instead holds
+// extents, runs of blocks contiguous both in the file and on
+// the disk, so a large file written in order maps with a few
+// of them and no indirect blocks.
+
+// Are ip's blocks file data, which need not be logged in
+// ordered mode? A directory's blocks are metadata.
+static int
+isdata(struct inode *ip)
+{
+  return ip->type != T_DIR;
+}
+
+// Does ip keep its data in ip->addrs[], rather than in blocks?
+// With FS_INLINE, every file and symbolic link small enough does.
+int
+iinline(struct inode *ip)
+{
+  if((sb.features & FS_INLINE) == 0 || ip->type == T_DIR || ip->type == T_DEVICE)
+    return 0;
+  return ip->size <= INLINESZ;
+}
+
+// Where to put a block of ip if nothing better is known: the
+// first data block of its block group.
+static uint
+igoal(struct inode *ip)
+{
+  if(sb.features & FS_GROUPS)
+    return IBLOCK(ip->inum - ip->inum % sb.ipg, sb) + sb.ipg / IPB;
+  return 0;
+}
+
+// Allocate a block of ip's content: the next of those writei()
+// set aside, if any, else one at goal, or near ip if goal is 0.
+static uint
+iballoc(struct inode *ip, uint goal)
+{
+  if(ip->palen > 0){
+    ip->palen--;
+    return ip->pastart++;
+  }
+  return balloc(ip, goal ? goal : igoal(ip), isdata(ip));
+}
+
+// The ith extent of ip, counting those in its extent block eb.
+static struct extent*
+iext(struct inode *ip, struct extblock *eb, int i)
+{
+  if(i < NEXTENT)
+    return (struct extent*)ip->addrs + i;
+  return &eb->e[i - NEXTENT];
+}
+
+// bmap() for an extent-mapped inode. Looks in the extent the
+// last call found first, then binary-searches the extents. An
+// unmapped block is allocated and added to the extent before
+// it if it lands right after that extent on the disk, and
+// otherwise gets an extent of its own.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct extent *e, *hint = &ip->ehint;
+  struct extblock *eb;
+  struct buf *bp;
+  int n, lo, hi, mid, i;
+  uint addr, ebaddr;
+
+  if(bn - hint->lstart < hint->len)
+    return hint->pstart + (bn - hint->lstart);
+
+  bp = 0;
+  eb = 0;
+  for(n = 0; n < NEXTENT && iext(ip, eb, n)->len; n++)
+    ;
+  if(n == NEXTENT && ip->addrs[EXTBLK]){
+    bp = bread(ip->dev, ip->addrs[EXTBLK]);
+    eb = (struct extblock*)bp->data;
+    n += eb->n;
+  }
+
+  // Find the last extent starting at or before bn.
+  lo = 0;
+  hi = n;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(iext(ip, eb, mid)->lstart <= bn)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  i = lo - 1;
+  e = i >= 0 ? iext(ip, eb, i) : 0;
+  if(e && bn - e->lstart < e->len){
+    *hint = *e;
+    addr = e->pstart + (bn - e->lstart);
+    goto out;
+  }
+
+  if((addr = iballoc(ip, e ? e->pstart + (bn - e->lstart) : 0)) == 0)
+    goto out;
+  if(e && e->lstart + e->len == bn && e->pstart + e->len == addr){
+    e->len++;
+  } else {
+    if(n == NEXTENT + NEXTBLK){
+      printf("bmap: out of extents\n");
+      bfree(ip->dev, addr);
+      addr = 0;
+      goto out;
+    }
+    if(n == NEXTENT && eb == 0){
+      if((ebaddr = balloc(ip, igoal(ip), 0)) == 0){
+        bfree(ip->dev, addr);
+        addr = 0;
+        goto out;
+      }
+      ip->addrs[EXTBLK] = ebaddr;
+      bp = bread(ip->dev, ebaddr);
+      eb = (struct extblock*)bp->data;
+    }
+    for(i = n; i > lo; i--)
+      *iext(ip, eb, i) = *iext(ip, eb, i - 1);
+    e = iext(ip, eb, lo);
+    e->lstart = bn;
+    e->pstart = addr;
+    e->len = 1;
+    if(eb)
+      eb->n = n + 1 - NEXTENT;
+  }
+  *hint = *e;
+  if(bp)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -385,9 +1056,12 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if(sb.features & FS_EXTENTS)
+    return emap(ip, bn);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = iballoc(ip, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +1073,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip, ip->addrs[NDIRECT-1] ? ip->addrs[NDIRECT-1] + 1 : igoal(ip), 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +1081,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = iballoc(ip, bn > 0 && a[bn-1] ? a[bn-1] + 1 : bp->blockno + 1);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -422,7 +1096,7 @@ bmap(struct inode *ip, uint bn)
   if (bn < NDOUBLEINDIRECT) {
     // Load double indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT + 1]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip, igoal(ip), 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT + 1] = addr;
@@ -432,7 +1106,7 @@ bmap(struct inode *ip, uint bn)
 
     // Load indirect block from double indirect block.
     if((addr = a[bn / NINDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip, igoal(ip), 0);
       if(addr == 0){
         brelse(bp);
         return 0;
@@ -446,7 +1120,8 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn % NINDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      uint k = bn % NINDIRECT;
+      addr = iballoc(ip, k > 0 && a[k-1] ? a[k-1] + 1 : bp->blockno + 1);
       if(addr){
         a[bn % NINDIRECT] = addr;
         log_write(bp);
@@ -460,15 +1135,225 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
+// itrunc() for an extent-mapped inode.
+static void
+etrunc(struct inode *ip)
+{
+  struct extblock *eb;
+  struct extent *e;
+  struct buf *bp;
+  int n, i;
+  uint b;
+
+  bp = 0;
+  eb = 0;
+  for(n = 0; n < NEXTENT && iext(ip, eb, n)->len; n++)
+    ;
+  if(ip->addrs[EXTBLK]){
+    bp = bread(ip->dev, ip->addrs[EXTBLK]);
+    eb = (struct extblock*)bp->data;
+    n += eb->n;
+  }
+  for(i = 0; i < n; i++){
+    e = iext(ip, eb, i);
+    for(b = 0; b < e->len; b++)
+      bfree(ip->dev, e->pstart + b);
+  }
+  if(bp){
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[EXTBLK]);
+  }
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->ehint.len = 0;
+  ip->size = 0;
+  iupdate(ip);
+}
+
+// Delayed allocation.
+//
+// With delayed allocation on (see delalloc()), writei() gives
+// the blocks an ordered-mode write adds to a regular file no
+// place on the disk yet: it keeps their data in pages, in
+// ip->delay[], and reserves free blocks for them. Since a file
+// has no holes, they are always its last blocks, from
+// ip->dblock on, and on disk the file ends before them.
+// dalloc() allocates them together, right after the file's
+// last block if those are free, and writes them, when the file
+// is closed or fsync()ed, at sync(), or when a write would
+// make more than NDELAY. So a file appended to a little at a
+// time, maybe by several processes at once, still gets its
+// blocks in a row, its bitmap block and i-node are logged once
+// for all of them, and a file removed before then never gets
+// any. Until then, a crash loses them, as it would if the
+// writes had not finished.
+
+static int dodelay;       // delayed allocation on?
+
+// Is block bn of ip a delayed block?
+int
+idelayed(struct inode *ip, uint bn)
+{
+  return ip->ndelay > 0 && bn >= ip->dblock;
+}
+
+// Reserve space for a delayed block, and for the indirect
+// blocks of ip's first, and return a zeroed page for its
+// data, or 0 if out of disk space or memory.
+static char*
+dadd(struct inode *ip, uint bn)
+{
+  int n = ip->ndelay == 0 ? 1 + NLEVEL : 1;
+  char *data;
+
+  if(breserve(n) < 0)
+    return 0;
+  if((data = kalloc()) == 0){
+    breserve(-n);
+    return 0;
+  }
+  memset(data, 0, BSIZE);
+  if(ip->ndelay == 0)
+    ip->dblock = bn;
+  ip->delay[ip->ndelay++] = data;
+  return data;
+}
+
+// Undo the last dadd().
+static void
+dpop(struct inode *ip)
+{
+  kfree(ip->delay[--ip->ndelay]);
+  breserve(ip->ndelay == 0 ? -(1 + NLEVEL) : -1);
+}
+
+// Discard ip's delayed blocks.
+static void
+ddrop(struct inode *ip)
+{
+  while(ip->ndelay > 0)
+    dpop(ip);
+}
+
+// Allocate ip's delayed blocks and write them. Caller must
+// hold ip->lock, inside a transaction that has reserved
+// LOG_FLUSH, or in ordered mode as much as writei() of them
+// would. Returns -1 if the disk is full, having dropped the
+// blocks that didn't fit: the file now ends before them.
+static int
+dalloc(struct inode *ip)
+{
+  struct buf *bp;
+  uint goal, addr;
+  int i, n;
+
+  if((n = ip->ndelay) == 0)
+    return 0;
+  // allocate the blocks, and any indirect blocks they need,
+  // from the reservation dadd() made for them.
+  ip->resv = n + NLEVEL;
+  goal = ip->dblock > 0 ? bmap(ip, ip->dblock - 1) + 1 : igoal(ip);
+  ip->pastart = ballocn(ip, goal, n, &ip->palen);
+  for(i = 0; i < n; i++){
+    if((addr = bmap(ip, ip->dblock + i)) == 0)
+      break;
+    bp = bnew(ip->dev, addr);
+    memmove(bp->data, ip->delay[i], BSIZE);
+    log_data(bp);
+    brelse(bp);
+  }
+  for(; ip->palen > 0; ip->palen--)
+    bfree(ip->dev, ip->pastart++);
+  breserve(-ip->resv);
+  ip->resv = 0;
+  if(i < n)
+    ip->size = min(ip->size, (ip->dblock + i) * BSIZE);
+  while(ip->ndelay > 0)
+    kfree(ip->delay[--ip->ndelay]);
+  iupdate(ip);
+  return i < n ? -1 : 0;
+}
+
+// Write ip's delayed blocks to disk, in a transaction of
+// their own. Caller must not hold ip->lock.
+int
+iflush(struct inode *ip)
+{
+  int r;
+
+  if(atomic_read4(&ip->ndelay) == 0)
+    return 0;
+  begin_op_n(LOG_FLUSH);
+  ilock(ip);
+  // an unlinked file's blocks never need to reach the disk:
+  // its last iput() discards them.
+  r = ip->nlink > 0 ? dalloc(ip) : 0;
+  iunlock(ip);
+  end_op();
+  return r;
+}
+
+// A linked i-node in bucket h with delayed blocks, or 0.
+static struct inode*
+ddirty(int h)
+{
+  struct inode *ip;
+
+  acquire(&itable_buckets[h].lock);
+  for(ip = itable_buckets[h].head; ip; ip = ip->hnext){
+    if(ip->ref > 0 && ip->nlink > 0 && atomic_read4(&ip->ndelay) > 0){
+      idup(ip);
+      break;
+    }
+  }
+  release(&itable_buckets[h].lock);
+  return ip;
+}
+
+// Write every file's delayed blocks to disk, for sync().
 void
-itrunc(struct inode *ip)
+iflushall(void)
+{
+  struct inode *ip;
+  int h;
+
+  for(h = 0; h < NIBUCKET; h++){
+    while((ip = ddirty(h)) != 0){
+      iflush(ip);
+      begin_op_n(LOG_IPUT);
+      iput(ip);
+      end_op();
+    }
+  }
+}
+
+// Turn delayed allocation on or off, if on >= 0. Turning it
+// off writes the delayed blocks there are. Returns the old
+// setting.
+int
+delalloc(int on)
+{
+  int old = dodelay;
+
+  if(on >= 0)
+    dodelay = on != 0;
+  if(on == 0)
+    iflushall();
+  return old;
+}
+
+// Free the blocks of ip, which isn't inline.
+static void
+btrunc(struct inode *ip)
 {
   int i, j;
   struct buf *bp;
   uint *a;
 
+  if(sb.features & FS_EXTENTS){
+    etrunc(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -514,6 +1399,21 @@ itrunc(struct inode *ip)
   iupdate(ip);
 }
 
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  ddrop(ip);
+  if(iinline(ip)){
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+  btrunc(ip);
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -526,6 +1426,53 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Move the data of inline file ip to a block of its own, as
+// writei() is about to make it too big for the i-node. ip stays
+// no bigger than INLINESZ until writei() is done with it, so
+// only writei() may see it meanwhile.
+static int
+iunline(struct inode *ip)
+{
+  char data[INLINESZ];
+  struct buf *bp;
+  uint addr;
+
+  memmove(data, ip->addrs, INLINESZ);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  memset(&ip->ehint, 0, sizeof(ip->ehint));
+  if(ip->size == 0)
+    return 0;
+  if((addr = bmap(ip, 0)) == 0){
+    memmove(ip->addrs, data, INLINESZ);
+    return -1;
+  }
+  bp = bread(ip->dev, addr);
+  memmove(bp->data, data, ip->size);
+  log_data(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Undo iunline().
+static void
+reinline(struct inode *ip)
+{
+  char data[INLINESZ];
+  struct buf *bp;
+  uint size;
+
+  size = ip->size;
+  memset(data, 0, INLINESZ);
+  if(size > 0){
+    bp = bread(ip->dev, bmap(ip, 0));
+    memmove(data, bp->data, size);
+    brelse(bp);
+  }
+  btrunc(ip);
+  memmove(ip->addrs, data, INLINESZ);
+  ip->size = size;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -541,12 +1488,25 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(iinline(ip)){
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1)
+      return -1;
+    return n;
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(idelayed(ip, off/BSIZE)){
+      if(either_copyout(user_dst, dst, ip->delay[off/BSIZE - ip->dblock] + (off % BSIZE), m) == -1) {
+        tot = -1;
+        break;
+      }
+      continue;
+    }
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -558,7 +1518,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 }
 
 // Write data to inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock. In journal mode, if ip has delayed
+// blocks, its transaction must have reserved LOG_FLUSH too.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
 // Returns the number of bytes successfully written.
@@ -567,31 +1528,109 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, have, need, goal;
   struct buf *bp;
+  char *data;
+  int wasinline, ordered, delay, fresh;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  wasinline = iinline(ip);
+  if(wasinline && off + n <= INLINESZ){
+    if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+      return 0;
+    if(off + n > ip->size)
+      ip->size = off + n;
+    iupdate(ip);
+    return n;
+  }
+  if(wasinline && iunline(ip) < 0)
+    return 0;
+
+  // Blocks from have on are not on the disk: the write adds
+  // them, or they are delayed. Blocks are delayed only in
+  // ordered mode, since in journal mode a file's data must go
+  // through the log with the rest of the write. So in journal
+  // mode, or if the write would make more than NDELAY delayed
+  // blocks, those there are go to disk first. A write that adds
+  // more than NDELAY blocks by itself gains nothing from
+  // delaying them.
+  need = (off + n + BSIZE - 1) / BSIZE;
+  ordered = log_ordered_op();
+  if(ip->ndelay > 0 && (!ordered || need > ip->dblock + NDELAY) &&
+     dalloc(ip) < 0)
+    return -1;
+  have = ip->ndelay > 0 ? ip->dblock : (ip->size + BSIZE - 1) / BSIZE;
+  delay = ordered && (ip->ndelay > 0 ||
+    (dodelay && ip->type == T_FILE && need > have && need - have <= NDELAY));
+
+  // Otherwise, allocate the blocks the write adds to the file
+  // together, right after its last block if they are free.
+  if(!delay && need > have){
+    goal = have > 0 ? bmap(ip, have - 1) + 1 : igoal(ip);
+    ip->pastart = ballocn(ip, goal, need - have, &ip->palen);
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(delay && off/BSIZE >= have){
+      fresh = off/BSIZE >= have + ip->ndelay;
+      if(!fresh)
+        data = ip->delay[off/BSIZE - have];
+      else if((data = dadd(ip, off/BSIZE)) == 0)
+        break;
+      if(either_copyin(data + (off % BSIZE), user_src, src, m) == -1) {
+        if(fresh)
+          dpop(ip);
+        break;
+      }
+      continue;
+    }
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
+    if(off/BSIZE >= have){
+      // A block new to the file, which ballocn() didn't zero:
+      // there is nothing in it to read, and what the write
+      // doesn't cover must read as zero.
+      bp = bnew(ip->dev, addr);
+      if(m < BSIZE)
+        memset(bp->data, 0, BSIZE);
+    } else {
+      bp = bread(ip->dev, addr);
+    }
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+      if(off/BSIZE >= have){
+        memset(bp->data, 0, BSIZE);
+        if(isdata(ip))
+          log_data(bp);
+        else
+          log_write(bp);
+      }
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(isdata(ip))
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
+  // Free any blocks set aside but not used.
+  for(; ip->palen > 0; ip->palen--)
+    bfree(ip->dev, ip->pastart++);
+
   if(off > ip->size)
     ip->size = off;
 
+  // A file that failed to outgrow its i-node goes back inside it.
+  if(wasinline && ip->size <= INLINESZ)
+    reinline(ip);
+
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
@@ -608,31 +1647,447 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache.
+//
+// The cache remembers what looking up a name in a directory
+// found: the entry's i-number and offset, or, with inum 0, that
+// there is no such entry. dirlookup() fills it in, and dirlink()
+// and sys_unlink() keep it up to date, with the directory
+// locked. namex() uses it without locking directories. A
+// directory's entries are dropped when it is freed, before its
+// i-number can be reused. dcache.lock protects everything here.
+
+struct dentry {
+  uint dev;
+  uint dir;               // directory i-number; 0 if unused
+  char name[DIRSIZ];
+  uint inum;              // 0 if the directory has no such entry
+  uint off;               // offset of the entry in the directory
+  struct dentry *hnext;   // hash bucket chain
+  struct dentry *lnext;   // LRU list
+  struct dentry *lprev;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *bucket[NDBUCKET];
+  struct dentry lru;      // lru.lnext is the most recently used
+} dcache;
+
+static void
+dcinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.lnext = dcache.lru.lprev = &dcache.lru;
+  for(d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++){
+    d->lnext = dcache.lru.lnext;
+    d->lprev = &dcache.lru;
+    dcache.lru.lnext->lprev = d;
+    dcache.lru.lnext = d;
+  }
+}
+
+static struct dentry**
+dcbucket(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return &dcache.bucket[h % NDBUCKET];
+}
+
+// Find the entry for name in directory dir, and make it the
+// most recently used. Caller must hold dcache.lock.
+static struct dentry*
+dcget(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dcbucket(dev, dir, name); d; d = d->hnext){
+    if(d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0){
+      d->lnext->lprev = d->lprev;
+      d->lprev->lnext = d->lnext;
+      d->lnext = dcache.lru.lnext;
+      d->lprev = &dcache.lru;
+      dcache.lru.lnext->lprev = d;
+      dcache.lru.lnext = d;
+      return d;
+    }
+  }
+  return 0;
+}
+
+// Take d out of its bucket and make it unused and the least
+// recently used. Caller must hold dcache.lock.
+static void
+dcdrop(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dcbucket(d->dev, d->dir, d->name); *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  d->dir = 0;
+  d->lnext->lprev = d->lprev;
+  d->lprev->lnext = d->lnext;
+  d->lprev = dcache.lru.lprev;
+  d->lnext = &dcache.lru;
+  dcache.lru.lprev->lnext = d;
+  dcache.lru.lprev = d;
+}
+
+// Look name up in directory dir in the cache. If it is there,
+// set *ipp to the referenced entry's i-node, or to 0 if there is
+// no such entry, set *poff to its offset if poff isn't 0, and
+// return 1. The i-node is referenced before the lock is dropped,
+// so that it can't be freed, and its i-number reused, first.
+static int
+dcfind(uint dev, uint dir, char *name, struct inode **ipp, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcget(dev, dir, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  *ipp = d->inum ? iget(dev, d->inum) : 0;
+  if(poff)
+    *poff = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp is i-node inum, at offset
+// off, or that there is no such entry if inum is 0.
+// Caller must hold dp->lock.
+void
+dcenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  struct dentry **b;
+
+  acquire(&dcache.lock);
+  if((d = dcget(dp->dev, dp->inum, name)) == 0){
+    d = dcache.lru.lprev;   // least recently used
+    if(d->dir)
+      dcdrop(d);
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    b = dcbucket(d->dev, d->dir, d->name);
+    d->hnext = *b;
+    *b = d;
+    dcget(d->dev, d->dir, d->name);
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Forget the entries of directory dir, which has been freed.
+static void
+dcpurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++)
+    if(d->dir == dir && d->dev == dev)
+      dcdrop(d);
+  release(&dcache.lock);
+}
+
+// Directory blocks.
+//
+// Directories are scanned a block at a time: dirnext() maps each
+// block once and the caller looks at its dirents in place, rather
+// than copying them out one readi() at a time. Set db->off to the
+// offset to start at and db->bp to 0, call dirnext() until it
+// returns 0, and call dirdone() if stopping before then.
+// Caller must hold dp->lock.
+
+// Advance db to the next block of directory dp. Returns 0 at the
+// end of the directory.
+int
+dirnext(struct inode *dp, struct dirblk *db)
+{
+  uint addr, end;
+
+  if(db->bp){
+    db->off += db->n * sizeof(struct dirent);
+    brelse(db->bp);
+    db->bp = 0;
+  }
+  if(db->off >= dp->size)
+    return 0;
+  if((addr = bmap(dp, db->off / BSIZE)) == 0)
+    panic("dirnext");
+  end = min(dp->size, db->off - db->off % BSIZE + BSIZE);
+  db->bp = bread(dp->dev, addr);
+  db->de = (struct dirent*)(db->bp->data + db->off % BSIZE);
+  db->n = (end - db->off) / sizeof(struct dirent);
+  return 1;
+}
+
+void
+dirdone(struct dirblk *db)
+{
+  if(db->bp){
+    brelse(db->bp);
+    db->bp = 0;
+  }
+}
+
+// Make dirnext() go on from offset off.
+static void
+dirseek(struct dirblk *db, uint off)
+{
+  dirdone(db);
+  db->off = off;
+}
+
+// Indexed directories.
+
+static uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// The index in directory block 0, bp, if it has one.
+static struct dxroot*
+dxroot(struct buf *bp)
+{
+  struct dxroot *r = (struct dxroot*)bp->data;
+
+  if((sb.features & FS_HTREE) == 0)
+    return 0;
+  if(r->zero != 0 || r->pad != 0 || r->magic != DXMAGIC)
+    return 0;
+  return r;
+}
+
+// The index entry for names that hash to h.
+static int
+dxfind(struct dxroot *r, uint h)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = r->n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(r->e[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Add a zeroed block to the end of directory dp, and return it
+// locked, with its block number in *bn.
+static struct buf*
+dirgrow(struct inode *dp, uint *bn)
+{
+  struct buf *bp;
+  uint addr;
+
+  *bn = dp->size / BSIZE;
+  if(*bn >= MAXFILE || (addr = bmap(dp, *bn)) == 0)
+    return 0;
+  dp->size = (*bn + 1) * BSIZE;
+  iupdate(dp);
+  bp = bread(dp->dev, addr);
+  memset(bp->data, 0, BSIZE);
+  return bp;
+}
+
+// Index directory dp, whose only block, bp, is full: move its
+// entries but "." and ".." to a new block 1, and put the index
+// in their place. Returns 0, or -1 if out of disk blocks.
+static int
+dxconvert(struct inode *dp, struct buf *bp)
+{
+  struct dxroot *r;
+  struct buf *lbp;
+  uint bn;
+
+  if((lbp = dirgrow(dp, &bn)) == 0)
+    return -1;
+  r = (struct dxroot*)bp->data;
+  memmove(lbp->data, &r->zero, BSIZE - 2*sizeof(struct dirent));
+  memset(&r->zero, 0, BSIZE - 2*sizeof(struct dirent));
+  r->magic = DXMAGIC;
+  r->n = 1;
+  r->e[0].hash = 0;
+  r->e[0].block = bn;
+  log_write(lbp);
+  log_write(bp);
+  brelse(lbp);
+  dcpurge(dp->dev, dp->inum);   // offsets have changed
+  return 0;
+}
+
+// Split dp's full leaf block bp, which index entry e of r maps:
+// move the entries with the larger half of the hashes to a new
+// block, and index it. Returns the new block, locked, or 0 if the
+// index is full, every name in bp has the same hash, or the disk
+// is full. The caller must log r's block.
+static struct buf*
+dxsplit(struct inode *dp, struct dxroot *r, int e, struct buf *bp)
+{
+  struct dirent *de, *nde;
+  struct buf *nbp;
+  uint *hash, *sorted, split, x, bn;
+  int i, j, k;
+
+  if(r->n >= NDXENTRY || (hash = (uint*)kalloc()) == 0)
+    return 0;
+  sorted = hash + DPB;
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB; i++){
+    hash[i] = dxhash(de[i].name);
+    for(j = i; j > 0 && sorted[j-1] > hash[i]; j--)
+      sorted[j] = sorted[j-1];
+    sorted[j] = hash[i];
+  }
+
+  // Split near the middle, between two different hashes.
+  for(k = DPB/2; k > 0 && sorted[k-1] == sorted[k]; k--)
+    ;
+  if(k == 0)
+    for(k = DPB/2; k < DPB && sorted[k-1] == sorted[k]; k++)
+      ;
+  if(k == DPB || (nbp = dirgrow(dp, &bn)) == 0){
+    kfree(hash);
+    return 0;
+  }
+  split = sorted[k];
+
+  nde = (struct dirent*)nbp->data;
+  for(i = j = 0; i < DPB; i++){
+    if(hash[i] >= split){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  kfree(hash);
+
+  for(x = r->n; x > e + 1; x--)
+    r->e[x] = r->e[x-1];
+  memset(&r->e[e+1], 0, sizeof(r->e[e+1]));
+  r->e[e+1].hash = split;
+  r->e[e+1].block = bn;
+  r->n++;
+  log_write(bp);
+  log_write(nbp);
+  dcpurge(dp->dev, dp->inum);   // offsets have changed
+  return nbp;
+}
+
+// dirlink() for an indexed directory, whose block 0 is rbp.
+static int
+dxlink(struct inode *dp, struct buf *rbp, char *name, uint inum)
+{
+  struct dxroot *r = (struct dxroot*)rbp->data;
+  struct dirent *de;
+  struct buf *bp, *nbp;
+  uint h, bn;
+  int e, i;
+
+  h = dxhash(name);
+  e = dxfind(r, h);
+  bn = r->e[e].block;
+  bp = bread(dp->dev, bmap(dp, bn));
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB && de[i].inum != 0; i++)
+    ;
+  if(i == DPB){
+    if((nbp = dxsplit(dp, r, e, bp)) == 0){
+      brelse(bp);
+      return -1;
+    }
+    log_write(rbp);
+    if(h >= r->e[e+1].hash){
+      brelse(bp);
+      bp = nbp;
+      bn = r->e[e+1].block;
+    } else {
+      brelse(nbp);
+    }
+    de = (struct dirent*)bp->data;
+    for(i = 0; de[i].inum != 0; i++)
+      ;
+  }
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  dcenter(dp, name, inum, bn * BSIZE + i * sizeof(struct dirent));
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint inum, off;
+  struct dirblk db;
+  struct dxroot *r;
+  struct inode *ip;
+  int i, indexed;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if(dcfind(dp->dev, dp->inum, name, &ip, poff))
+    return ip;
+
+  db.off = 0;
+  db.bp = 0;
+  indexed = 0;
+  while(dirnext(dp, &db)){
+    for(i = 0; i < db.n; i++){
+      if(db.de[i].inum == 0)
+        continue;
+      if(namecmp(name, db.de[i].name) == 0){
+        // entry matches path element
+        off = db.off + i * sizeof(struct dirent);
+        if(poff)
+          *poff = off;
+        inum = db.de[i].inum;
+        dirdone(&db);
+        dcenter(dp, name, inum, off);
+        return iget(dp->dev, inum);
+      }
+    }
+    if(indexed){
+      dirdone(&db);
+      break;
+    }
+    if(db.off == 0 && (r = dxroot(db.bp)) != 0){
+      // Only the block the index gives can hold name.
+      dirseek(&db, r->e[dxfind(r, dxhash(name))].block * BSIZE);
+      indexed = 1;
     }
   }
 
+  dcenter(dp, name, 0, 0);
   return 0;
 }
 
@@ -641,8 +2096,10 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  int i, r;
+  uint off;
   struct dirent de;
+  struct dirblk db;
   struct inode *ip;
 
   // Check that name is not present.
@@ -651,22 +2108,82 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  // Look for an empty dirent, and fill it in where it is.
+  db.off = 0;
+  db.bp = 0;
+  while(dirnext(dp, &db)){
+    if(db.off == 0 && dxroot(db.bp)){
+      r = dxlink(dp, db.bp, name, inum);
+      dirdone(&db);
+      return r;
+    }
+    for(i = 0; i < db.n; i++){
+      if(db.de[i].inum == 0){
+        off = db.off + i * sizeof(struct dirent);
+        strncpy(db.de[i].name, name, DIRSIZ);
+        db.de[i].inum = inum;
+        log_write(db.bp);
+        dirdone(&db);
+        dcenter(dp, name, inum, off);
+        return 0;
+      }
+    }
+    // A full first block, and nothing after it: index the
+    // directory, rather than growing it.
+    if(db.off == 0 && db.n == DPB && dp->size == BSIZE && (sb.features & FS_HTREE)){
+      r = dxconvert(dp, db.bp);
+      if(r == 0)
+        r = dxlink(dp, db.bp, name, inum);
+      dirdone(&db);
+      return r;
+    }
   }
 
+  // None free; append one.
+  off = dp->size;
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcenter(dp, name, inum, off);
 
   return 0;
 }
 
+// Copy the entries of directory dp in use, from *poff on, to dst,
+// as many whole ones as fit in n bytes, and advance *poff past the
+// ones copied. Returns the number of bytes copied, 0 at the end of
+// the directory, or -1 if dst is bad.
+// Caller must hold dp->lock.
+int
+getdents(struct inode *dp, uint64 dst, uint *poff, int n)
+{
+  struct dirblk db;
+  int i, tot;
+
+  tot = 0;
+  db.off = *poff - *poff % sizeof(struct dirent);
+  db.bp = 0;
+  while(dirnext(dp, &db)){
+    for(i = 0; i < db.n; i++){
+      if(db.de[i].inum == 0)
+        continue;
+      if(tot + sizeof(struct dirent) > n){
+        *poff = db.off + i * sizeof(struct dirent);
+        dirdone(&db);
+        return tot;
+      }
+      if(copyout(myproc()->pagetable, dst + tot, (char*)&db.de[i], sizeof(struct dirent)) < 0){
+        dirdone(&db);
+        return -1;
+      }
+      tot += sizeof(struct dirent);
+    }
+  }
+  *poff = db.off;
+  return tot;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -706,21 +2223,31 @@ skipelem(char *path, char *name)
   return path;
 }
 
-// Look up and return the inode for a path name.
+// Look up and return the inode for a path name, relative to
+// directory dp if it isn't 0, and else to the current directory.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 // Must be called inside a transaction since it calls iput().
 static struct inode*
-namex(char *path, int nameiparent, char *name)
+namex(struct inode *dp, char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(dp ? dp : myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // Only directories have cached entries, so ip is one if
+    // name is in the cache.
+    if((!nameiparent || *path != '\0') && dcfind(ip->dev, ip->inum, name, &next, 0)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -749,11 +2276,19 @@ struct inode*
 namei(char *path)
 {
   char name[DIRSIZ];
-  return namex(path, 0, name);
+  return namex(0, path, 0, name);
 }
 
 struct inode*
 nameiparent(char *path, char *name)
 {
-  return namex(path, 1, name);
+  return namex(0, path, 1, name);
+}
+
+// namei(), relative to directory dp rather than the current one.
+struct inode*
+nameiat(struct inode *dp, char *path)
+{
+  char name[DIRSIZ];
+  return namex(dp, path, 0, name);
 }
@@ -13,6 +13,10 @@
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
+// or, with FS_GROUPS, the blocks after the log are split into block
+// groups of sb.bpg blocks, each laid out as
+// [ free bit map block | sb.ipg inodes | data blocks ]
+//
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
 struct superblock {
@@ -24,10 +28,25 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint features;     // FS_* flags
+  uint gstart;       // Block number of first block group
+  uint ngroups;      // Number of block groups
+  uint bpg;          // Blocks per group
+  uint ipg;          // Inodes per group
 };
 
 #define FSMAGIC 0x10203040
 
+#define FS_EXTENTS 0x1   // i-nodes map their blocks with extents
+#define FS_GROUPS  0x2   // blocks and inodes are in block groups
+#define FS_HTREE   0x4   // directories over a block are hash-indexed
+#define FS_INLINE  0x8   // small files keep their data in the dinode
+
+// mkfs makes at least NGROUP block groups, unless a group's bitmap
+// would need more than one block.
+#define NGROUP 8
+#define BPG (FSSIZE/NGROUP < BPB ? FSSIZE/NGROUP : BPB)
+
 #ifdef LAB_FS
 #define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
@@ -53,17 +72,73 @@ struct dinode {
   #endif
 };
 
+// In a file system with FS_INLINE, a file or symbolic link of at
+// most INLINESZ bytes instead holds its data in addrs[].
+#define INLINESZ 52     // sizeof(addrs)
+
+// In a file system with FS_EXTENTS, a dinode's addrs[] instead
+// holds NEXTENT extents, sorted by logical block, followed by the
+// address of an extent block, which holds any more.
+struct extent {
+  uint lstart;          // first block in the file
+  uint pstart;          // first block on the disk
+  uint len;             // number of blocks; 0 if unused
+};
+
+#define NEXTENT 4                 // extents in a dinode
+#define EXTBLK  (NEXTENT * 3)     // addrs[] index of the extent block
+#define NEXTBLK ((BSIZE - sizeof(uint)) / sizeof(struct extent))
+
+struct extblock {
+  uint n;                         // extents in use
+  struct extent e[];              // NEXTBLK of them
+};
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
+// First block of block group g
+#define GSTART(g, sb) ((sb).gstart + (g) * (sb).bpg)
+
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb) ((sb).features & FS_GROUPS ? \
+  GSTART((i) / (sb).ipg, sb) + 1 + (i) % (sb).ipg / IPB : (i) / IPB + (sb).inodestart)
 
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
+// Block group of block b, which without FS_GROUPS is the
+// number of the free map block holding its bit.
+#define BGROUP(b, sb) ((sb).features & FS_GROUPS ? ((b) - (sb).gstart) / (sb).bpg : (b) / BPB)
+
 // Block of free map containing bit for block b
-#define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
+#define BBLOCK(b, sb) ((sb).features & FS_GROUPS ? \
+  GSTART(BGROUP(b, sb), sb) : (b)/BPB + (sb).bmapstart)
+
+// Worst-case numbers of blocks FS system calls log, which they
+// reserve with begin_op_n(). balloc() hands out runs of free
+// blocks next-fit, so n blocks allocated together are assumed
+// to span at most BITMAPS(n) bitmap blocks, counting a bitmap
+// block per block group. A file's blocks, allocated over time,
+// may be in every group, so freeing them may log NBITMAP.
+#ifdef LAB_FS
+#define NLEVEL 2     // levels of indirect blocks
+#else
+#define NLEVEL 1
+#endif
+#define NDELAY 16    // most delayed blocks an i-node holds; see dalloc()
+#define NBITMAP       (FSSIZE/BPG + 1)  // most bitmap blocks, or groups
+#define BITMAPS(n)    ((n)/BPG + 2 < NBITMAP ? (n)/BPG + 2 : NBITMAP)
+#define LOG_IPUT      (1 + NBITMAP)  // freeing an i-node and its blocks
+#define LOG_LOOKUP    (1 + NBITMAP)  // freeing a removed (empty) directory,
+                                     // which may have any number of blocks
+#define LOG_GROW      (1 + NLEVEL + BITMAPS(1 + NLEVEL)) // adding a block to a file
+#define LOG_DIRLINK   (3 + LOG_GROW)          // adding a directory entry, which
+                                              // may split an indexed directory's block
+#define LOG_CREATE    (LOG_LOOKUP + 1 + LOG_DIRLINK + LOG_GROW) // a new i-node,
+                                              // and a new directory's first block
+#define LOG_FLUSH     (1 + 2*NLEVEL + BITMAPS(NDELAY + 2*NLEVEL) + NDELAY) // giving an
+                                              // i-node's delayed blocks a place on disk
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -72,3 +147,37 @@ struct dirent {
   ushort inum;
   char name[DIRSIZ];
 };
+
+// Dirents per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// With FS_HTREE, a directory that outgrows its first block is
+// indexed: block 0 keeps "." and "..", and holds in the rest of
+// its slots, where a linear scan sees only free dirents, a header
+// and an index sorted by hash. The names whose 32-bit FNV-1a hash
+// (over at most DIRSIZ bytes) is at least e[i].hash, and less than
+// e[i+1].hash, are in directory block e[i].block, an ordinary
+// block of dirents. e[0].hash is 0.
+#define DXMAGIC 0x78746864
+
+struct dxentry {
+  ushort zero;          // a free dirent's inum
+  ushort pad;           // 0, unlike the first byte of a name
+  uint hash;
+  uint block;
+  uint unused;
+};
+
+struct dxroot {
+  struct dirent dot;
+  struct dirent dotdot;
+  ushort zero;
+  ushort pad;
+  uint magic;           // DXMAGIC
+  uint n;               // index entries in use
+  uint unused;
+  struct dxentry e[];   // NDXENTRY of them
+};
+
+#define NDXENTRY ((BSIZE - sizeof(struct dxroot)) / sizeof(struct dxentry))
+
@@ -0,0 +1,34 @@
+#define NIOLAT 24  // latency histogram buckets
+
+// Block I/O statistics, returned by the iostat() system call.
+struct iostat {
+  uint64 nread;      // blocks read from disk
+  uint64 nwrite;     // blocks written to disk
+  uint64 nreq;       // disk requests, each moving one or more adjacent blocks
+  uint64 nnotify;    // times the device was notified of new requests
+  uint64 maxinflight; // most requests the device held at once
+  uint64 nintr;      // disk interrupts
+  uint64 npolled;    // waits for the disk that ended while polling
+  uint64 ra_issued;  // blocks read ahead
+  uint64 ra_hits;    // read-ahead blocks later found by bread()
+  uint64 ra_wasted;  // read-ahead blocks evicted without being used
+  uint64 lat[NIOLAT]; // blocks by queue-to-completion time:
+                      // lat[i] took less than 2^i microseconds
+  uint64 ncommit;    // log transactions committed
+  uint64 nops;       // FS system calls in them
+  uint64 concur;     // sum, over FS system calls, of how many were
+                     // running in the transaction as each began
+  uint64 nlogwait;   // times an FS system call waited for log space
+  uint64 nbread;     // bread() calls, whether or not the block was cached
+};
+
+// Tunable block I/O parameters, for iotune().
+#define IOT_SCHED  0  // I/O scheduler
+#define IOT_POLL   1  // microseconds to poll for a disk completion before sleeping
+#define IOT_ASYNC  2  // 1: system calls return before their log commit
+#define IOT_ORDERED 3 // 1: file data is written home, not logged
+#define IOT_FIXEDRSV 4 // 1: every FS system call reserves MAXOPBLOCKS log blocks
+#define IOT_DELALLOC 5 // 1: appended file blocks get disk blocks at close or fsync
+
+#define IOSCHED_NOOP      0  // first come, first served
+#define IOSCHED_DEADLINE  1  // C-LOOK with deadlines
@@ -6,50 +6,117 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
+#include "iostat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A system call should call begin_op_n()/end_op() to mark
+// its start and end; its updates go to the open transaction.
+// begin_op_n(n) reserves log space for the n blocks the call may
+// log at most, and returns. But if the open transaction does not
+// have that much space left, it sleeps until that transaction
+// has been committed.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// log_write() does not take log.lock. A buffer records the
+// transaction that last logged it, so a block logged again is
+// absorbed at once, and a new block is staged on the calling
+// CPU. The commit thread merges the CPUs' staged blocks into the
+// log header once the transaction's sys calls have finished.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// Commits are done by a kernel thread, committer(). It commits
+// the open transaction when someone waits for it, or once it has
+// been open for COMMITTICKS. First it freezes the transaction:
+// new system calls wait until the outstanding ones have finished
+// and the transaction's cached blocks have been locked. Thus there
+// is never any reasoning required about whether the log might get
+// an uncommitted system call's updates. Then a new transaction
+// opens, and takes new system calls while the old one is written
+// to the log, straight from the cache, and then installed.
+//
+// Install writes the cached blocks home unlocked, so a block may
+// change under it if the new transaction has logged it too. That
+// is all right: until the new transaction commits, recovery
+// replays the old one, and afterwards the new one, which has the
+// block.
+//
+// Normally the last end_op() of a transaction waits for its
+// commit. In async mode (log_async()) end_op() returns at once;
+// fsync() and sync() wait for the commit with log_force().
+// Either way a transaction reaches the disk all or nothing.
+//
+// In ordered mode (log_ordered()) file data does not go through
+// the log. log_data() pins a data block in the open transaction,
+// and the commit writes it home before the log, so a committed
+// transaction never refers to data that is not on disk.
+//
+// The log is a physical re-do log containing disk blocks, split
+// into two regions that successive transactions use in turn.
+// The on-disk format of each region:
+//   header block, containing the transaction's seq, a checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The header and the blocks are written as one batch, in any
+// order. The checksum covers the header and the blocks, so a
+// region whose checksum matches holds a whole committed
+// transaction, and one that does not was never committed.
+// Regions are not erased after install; recovery replays only
+// the valid region with the highest seq.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;
+  uint cksum;
   int n;
   int block[LOGSIZE];
 };
 
+// Blocks logged on one CPU, pinned, until the commit merges them.
+struct stage {
+  int n;
+  struct buf *buf[LOGSIZE];
+};
+
+// An in-memory transaction. trans[i] uses log region i.
+struct trans {
+  uint seq;        // transactions are numbered in commit order
+  int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks they have reserved
+  int staged;      // log blocks logged by its finished FS sys calls
+  int nops;        // how many FS sys calls it contains
+  uint opened;     // ticks when its first block was logged
+  int ordered;     // file data bypasses the log
+  struct buf *buf[LOGSIZE]; // the logged blocks, pinned in the cache
+  struct logheader lh;
+  int ndata;
+  struct buf *data[DATASIZE]; // ordered data blocks, pinned
+  struct stage stage[NCPU];
+};
+
 struct log {
   struct spinlock lock;
   int start;
-  int size;
-  int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int size;        // blocks in each region
   int dev;
-  struct logheader lh;
+  struct trans trans[2];
+  struct trans *open; // the transaction new FS sys calls join
+  int frozen;      // open transaction is being committed; please wait.
+  int want;        // someone waits for the open transaction to commit.
+  int async;       // end_op() does not wait for the commit.
+  int ordered;     // mode of transactions opened from now on
+  int fixedrsv;    // every FS sys call reserves MAXOPBLOCKS
+  uint installed;  // seq of the last transaction installed
+  uint durable;    // seq of the last transaction committed to disk
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -59,152 +126,461 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog / 2;
   log.dev = dev;
+  if (log.size < LOGSIZE + 1)
+    panic("initlog: log too small");
   recover_from_log();
+  log.ordered = 1;
+  log.open->ordered = log.ordered;
+  kthread("committer", committer);
 }
 
-// Copy committed blocks from log to their home location
+// Block number of t's log header; its log blocks follow.
+static uint
+logstart(struct trans *t)
+{
+  return log.start + (t - log.trans) * log.size;
+}
+
+// Copy committed blocks from t's log region to their home location.
+// The log blocks are read, and the home blocks written, as
+// batches, so the disk sees a few large requests.
 static void
-install_trans(int recovering)
+install_trans(struct trans *t)
 {
   int tail;
+  uint lblocks[LOGSIZE];
+  struct buf *lbufs[LOGSIZE];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  for (tail = 0; tail < t->lh.n; tail++)
+    lblocks[tail] = logstart(t)+tail+1;
+  bread_multi(log.dev, lblocks, t->lh.n, lbufs); // read log blocks
+  bwrite_multi(lbufs, (uint*)t->lh.block, t->lh.n);  // write them home
+  for (tail = 0; tail < t->lh.n; tail++)
+    brelse(lbufs[tail]);
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// FNV-1a hash of n bytes at data, continuing from h.
+static uint
+cksum(uint h, void *data, int n)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
-  brelse(buf);
+  uchar *p = data;
+
+  while(n-- > 0)
+    h = (h ^ *p++) * 16777619;
+  return h;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Checksum of header lh and the log blocks bufs[0..lh->n).
+static uint
+trans_cksum(struct logheader *lh, struct buf **bufs)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  uint h = 2166136261;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  h = cksum(h, &lh->seq, sizeof(lh->seq));
+  h = cksum(h, &lh->n, sizeof(lh->n));
+  h = cksum(h, lh->block, lh->n * sizeof(lh->block[0]));
+  for (i = 0; i < lh->n; i++)
+    h = cksum(h, bufs[i]->data, BSIZE);
+  return h;
+}
+
+// Read t's log header from disk into its in-memory log header.
+// Returns 1 if the region holds a whole committed transaction.
+static int
+read_head(struct trans *t)
+{
+  struct buf *buf = bread(log.dev, logstart(t));
+  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *lbufs[LOGSIZE];
+  uint lblocks[LOGSIZE];
+  int i, ok;
+
+  t->lh.seq = lh->seq;
+  t->lh.cksum = lh->cksum;
+  t->lh.n = lh->n;
+  if (t->lh.n < 0 || t->lh.n > LOGSIZE) {
+    brelse(buf);
+    return 0;
+  }
+  for (i = 0; i < t->lh.n; i++) {
+    t->lh.block[i] = lh->block[i];
+    lblocks[i] = logstart(t)+i+1;
   }
-  bwrite(buf);
   brelse(buf);
+  bread_multi(log.dev, lblocks, t->lh.n, lbufs);
+  ok = trans_cksum(&t->lh, lbufs) == t->lh.cksum;
+  for (i = 0; i < t->lh.n; i++)
+    brelse(lbufs[i]);
+  return ok;
 }
 
+// A region is reused only after its transaction has been
+// installed, and a transaction commits only after the one
+// before it has been installed. So the blocks of every valid
+// region but the newest are home already, or in the newest.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct trans *last = 0;
+
+  for (int i = 0; i < 2; i++) {
+    struct trans *t = &log.trans[i];
+    if (read_head(t) && (last == 0 || t->lh.seq > last->lh.seq))
+      last = t;
+  }
+  if (last) {
+    install_trans(last); // copy from log to disk
+    // carry on from its seq, so that a new transaction
+    // never looks older than one left in the log.
+    log.open = &log.trans[last == &log.trans[0]];
+    log.open->seq = last->lh.seq + 1;
+  } else {
+    log.open = &log.trans[0];
+    log.open->seq = 1;
+  }
+  log.durable = log.open->seq - 1;
+  log.installed = log.durable;
+  log.trans[0].lh.n = 0;
+  log.trans[1].lh.n = 0;
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that logs
+// at most n blocks.
 void
-begin_op(void)
+begin_op_n(int n)
 {
+  struct proc *p = myproc();
+
+  if(n > LOGSIZE)
+    panic("begin_op_n");
   acquire(&log.lock);
+  if(log.fixedrsv && n < MAXOPBLOCKS)
+    n = MAXOPBLOCKS;
   while(1){
-    if(log.committing){
+    struct trans *t = log.open;
+    if(log.frozen){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(t->staged + t->reserved + n > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      iostat.nlogwait++;
+      log.want = 1;
+      wakeup(&log);
       sleep(&log, &log.lock);
     } else {
-      log.outstanding += 1;
+      t->outstanding += 1;
+      t->nops += 1;
+      t->reserved += n;
+      p->logresv = n;
+      p->logused = 0;
+      iostat.concur += t->outstanding;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of an FS system call that has
+// no reservation of its own.
+void
+begin_op(void)
+{
+  begin_op_n(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation, waits
+// for the transaction to commit, unless in async mode.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct trans *t;
+  struct proc *p = myproc();
 
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  t = log.open;
+  t->outstanding -= 1;
+  t->reserved -= p->logresv;
+  if(p->logused > 0 && t->staged + t->ndata == 0)
+    t->opened = ticks;
+  t->staged += p->logused;
+  p->logresv = p->logused = 0;
+  if(t->outstanding == 0 && t->staged + t->ndata > 0 && !log.async){
+    // ask the commit thread to commit now, and wait for it,
+    // as if we had committed the transaction ourselves.
+    uint seq = t->seq;
+    log.want = 1;
+    wakeup(&log);
+    while(log.durable < seq)
+      sleep(&log, &log.lock);
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_op_n() may be waiting for log space,
+    // and this op's reservation has been returned. the commit
+    // thread may be waiting for outstanding to drop.
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// Write t to the log, commit it, and install it. lbufs[]
+// holds t's cached blocks, and dbufs[] its ordered data
+// blocks, locked, in t's order; the next transaction may
+// already be open.
+static void
+commit(struct trans *t, struct buf **lbufs, struct buf **dbufs)
+{
+  struct buf *hbuf;
+  struct logheader *hb;
+  uint lblocks[LOGSIZE+1];
+  int tail, n;
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+  // ordered data goes home first.
+  bwrite_multi(dbufs, 0, t->ndata);
+  for (tail = 0; tail < t->ndata; tail++) {
+    brelse(dbufs[tail]);
+    bunpin(t->data[tail]);
+  }
+  t->ndata = 0;
+
+  // the header goes out with the log blocks, in one batch;
+  // once all of them are on disk, t has committed.
+  t->lh.seq = t->seq;
+  t->lh.cksum = trans_cksum(&t->lh, lbufs);
+  hbuf = bget(log.dev, logstart(t));
+  hb = (struct logheader *) (hbuf->data);
+  hb->seq = t->lh.seq;
+  hb->cksum = t->lh.cksum;
+  hb->n = t->lh.n;
+  for (tail = 0; tail < t->lh.n; tail++)
+    hb->block[tail] = t->lh.block[tail];
+  hbuf->valid = 1;
+  for (tail = 0; tail < t->lh.n; tail++)
+    lblocks[tail] = logstart(t)+tail+1;
+  lbufs[t->lh.n] = hbuf;
+  lblocks[t->lh.n] = logstart(t);
+  bwrite_multi(lbufs, lblocks, t->lh.n + 1);
+  for (tail = 0; tail <= t->lh.n; tail++)
+    brelse(lbufs[tail]);
+
+  acquire(&log.lock);
+  log.durable = t->seq;
+  iostat.ncommit++;
+  iostat.nops += t->nops;
+  wakeup(&log);
+  release(&log.lock);
+
+  // Now install writes to home locations, from the cache. A
+  // block the next transaction has logged again is left for
+  // that transaction to install.
+  n = 0;
+  acquire(&log.lock);
+  for (tail = 0; tail < t->lh.n; tail++) {
+    if (t->buf[tail]->logseq == t->seq)
+      lbufs[n++] = t->buf[tail];
+  }
+  release(&log.lock);
+  bwrite_pinned(lbufs, n);
+  for (tail = 0; tail < t->lh.n; tail++)
+    bunpin(t->buf[tail]);
+  t->lh.n = 0;
+
+  acquire(&log.lock);
+  log.installed = t->seq;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Gather the blocks t's FS sys calls staged on each CPU
+// into t's log header. t must be frozen, with no sys calls
+// left running.
+static void
+merge(struct trans *t)
+{
+  struct stage *s;
+  int i;
+
+  t->lh.n = 0;
+  for (s = t->stage; s < &t->stage[NCPU]; s++) {
+    for (i = 0; i < s->n; i++) {
+      if (t->lh.n >= LOGSIZE)
+        panic("too big a transaction");
+      t->buf[t->lh.n] = s->buf[i];
+      t->lh.block[t->lh.n++] = s->buf[i]->blockno;
+    }
+    s->n = 0;
+  }
+  t->staged = 0;
+}
+
+// The commit thread. Commits the open transaction once someone
+// waits for it, or it has been open for COMMITTICKS.
+static void
+committer(void)
+{
+  struct buf *lbufs[LOGSIZE+1]; // log blocks and header
+  struct buf *dbufs[DATASIZE];
+  struct trans *t;
+
+  acquire(&log.lock);
+  for(;;){
+    t = log.open;
+    if(t->staged + t->ndata == 0 || (!log.want && ticks - t->opened < COMMITTICKS)){
+      sleep(&log, &log.lock);
+      continue;
+    }
+
+    // freeze t until its FS sys calls have finished,
+    // and its blocks have been locked.
+    log.frozen = 1;
+    while(t->outstanding > 0)
+      sleep(&log, &log.lock);
+    log.want = 0;
+    merge(t);
+    release(&log.lock);
+
+    bread_multi(log.dev, (uint*)t->lh.block, t->lh.n, lbufs);
+    for (int i = 0; i < t->ndata; i++)
+      dbufs[i] = bread(log.dev, t->data[i]->blockno);
+
+    // the other transaction is done with its region, so
+    // it can take new FS sys calls while t commits.
     acquire(&log.lock);
-    log.committing = 0;
+    log.open = &log.trans[t == &log.trans[0]];
+    log.open->seq = t->seq + 1;
+    log.open->nops = 0;
+    log.open->ordered = log.ordered;
+    log.frozen = 0;
     wakeup(&log);
     release(&log.lock);
+
+    commit(t, lbufs, dbufs);
+
+    acquire(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
-static void
-write_log(void)
+// The sequence number of the open transaction, which
+// an FS system call in progress belongs to.
+uint
+log_seq(void)
 {
-  int tail;
+  uint seq;
+
+  acquire(&log.lock);
+  seq = log.open->seq;
+  release(&log.lock);
+  return seq;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Wait until transaction seq, and those before it, are on disk.
+void
+log_force(uint seq)
+{
+  acquire(&log.lock);
+  while(log.durable < seq){
+    struct trans *t = log.open;
+    if(seq == t->seq){
+      if(t->staged + t->ndata == 0 && t->outstanding == 0){
+        // nothing to commit in it.
+        seq--;
+        continue;
+      }
+      log.want = 1;
+      wakeup(&log);
+    }
+    sleep(&log, &log.lock);
   }
+  release(&log.lock);
+}
+
+// Turn ordered mode on or off, if ordered >= 0, for the
+// transactions that open from now on. Returns the old mode.
+int
+log_ordered(int ordered)
+{
+  int old;
+
+  acquire(&log.lock);
+  old = log.ordered;
+  if(ordered >= 0)
+    log.ordered = ordered != 0;
+  release(&log.lock);
+  return old;
+}
+
+// Is the open transaction in ordered mode? After begin_op_n(),
+// that is the calling FS sys call's transaction, which cannot
+// change before the call's end_op().
+int
+log_ordered_op(void)
+{
+  int ordered;
+
+  acquire(&log.lock);
+  ordered = log.open->ordered;
+  release(&log.lock);
+  return ordered;
+}
+
+// If fixed >= 0, make every FS sys call reserve at least
+// MAXOPBLOCKS log blocks, as they all used to, or only what
+// it asks for. Returns the old setting.
+int
+log_fixedrsv(int fixed)
+{
+  int old;
+
+  acquire(&log.lock);
+  old = log.fixedrsv;
+  if(fixed >= 0)
+    log.fixedrsv = fixed != 0;
+  release(&log.lock);
+  return old;
+}
+
+// Turn async commit mode on or off, if async >= 0.
+// Returns the old mode.
+int
+log_async(int async)
+{
+  int old = log.async;
+
+  if(async >= 0)
+    log.async = async != 0;
+  return old;
+}
+
+// Called on each clock tick, so that the commit thread
+// notices a transaction that has been open for long.
+void
+log_tick(void)
+{
+  if(ticks % COMMITTICKS == 0)
+    wakeup(&log);
 }
 
+// Take b, an ordered data block of t, off t's data
+// list; b stays pinned.
 static void
-commit()
+undata(struct trans *t, struct buf *b)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int i;
+
+  for (i = 0; i < t->ndata; i++) {
+    if (t->data[i] == b) {
+      t->data[i] = t->data[--t->ndata];
+      b->dataseq = 0;
+      return;
+    }
   }
+  panic("undata");
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The commit thread will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,23 +590,73 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  struct trans *t = log.open; // cannot change while we are in it
+  struct proc *p = myproc();
+  struct stage *s;
 
-  acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (t->outstanding < 1)
     panic("log_write outside of trans");
+  if (b->logseq == t->seq)   // log absorption
+    return;
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
-      break;
-  }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (b->dataseq == t->seq) {
+    // b was ordered data earlier in t; log it instead.
+    acquire(&log.lock);
+    undata(t, b);
+    release(&log.lock);
+  } else {
     bpin(b);
-    log.lh.n++;
   }
-  release(&log.lock);
+  b->logseq = t->seq;
+#ifdef LOGDEBUG
+  if (p->logused >= p->logresv)
+    panic("log_write: op exceeds its reservation");
+#endif
+  p->logused++;
+
+  push_off();
+  s = &t->stage[cpuid()];
+  if (s->n >= LOGSIZE)
+    panic("too big a transaction");
+  s->buf[s->n++] = b;
+  pop_off();
 }
 
+// Like log_write(), for a block of file data. In ordered mode
+// the block is not logged, but written home before the open
+// transaction commits.
+void
+log_data(struct buf *b)
+{
+  struct trans *t;
+
+  acquire(&log.lock);
+  t = log.open;
+  if (t->outstanding < 1)
+    panic("log_data outside of trans");
+  if (!t->ordered || b->logseq == t->seq) {
+    // not ordered, or logged already.
+    release(&log.lock);
+    log_write(b);
+    return;
+  }
+  if (b->dataseq == t->seq) {   // absorption
+    release(&log.lock);
+    return;
+  }
+  if (t->ndata == DATASIZE) {
+    // no room; write it home now. the previous transaction
+    // must have been installed, lest it overwrite b later.
+    while (log.installed + 1 < t->seq)
+      sleep(&log, &log.lock);
+    release(&log.lock);
+    bwrite(b);
+    return;
+  }
+  bpin(b);
+  b->dataseq = t->seq;
+  if (t->staged + t->ndata == 0)
+    t->opened = ticks;
+  t->data[t->ndata++] = b;
+  release(&log.lock);
+}
@@ -6,14 +6,22 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // i-nodes cached; more are allocated while in use
+#define NIBUCKET     17  // number of hash buckets in inode cache
+#define NDENTRY     128  // size of directory entry cache
+#define NDBUCKET     31  // number of hash buckets in directory entry cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
+#define LOGSIZE      (MAXOPBLOCKS*12)  // max data blocks in a transaction
+#define MAXOPDATA    32  // max file data blocks an FS op writes, in ordered mode
+#define DATASIZE     (MAXOPDATA*2)  // max ordered data blocks in a transaction
+#define COMMITTICKS  10  // commit a transaction at least this often
 #define NBUCKET      17  // number of hash buckets in buffer cache
-#define NBUF         (NBUCKET*3)  // size of disk block cache
+#define NBUF         (NBUCKET*30)  // size of disk block cache
+#define NVQ          8  // maximum number of virtio disk queues
+#define MAXRABLOCKS  16  // max read-ahead window of an open file
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
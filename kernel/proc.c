@@ -5,9 +5,9 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
 #ifdef LAB_MMAP
 #include "sleeplock.h"
-#include "fs.h"
 #include "file.h"
 #endif
 
@@ -129,6 +129,10 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->plugged = 0;
+  p->plughead = p->plugtail = 0;
+  p->logresv = p->logused = 0;
+  p->kfn = 0;
   #ifdef LAB_SYSCALL
   p->trace_mask = 0;
   #endif
@@ -336,6 +340,36 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread, a process that runs fn() in the
+// kernel and never returns to user space.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -483,7 +517,7 @@ exit(int status)
     }
   }
 
-  begin_op();
+  begin_op_n(LOG_LOOKUP);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
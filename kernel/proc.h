@@ -117,6 +117,12 @@ struct proc {
   struct file *ofile[NOFILE];        // Open files
   struct inode *cwd;                 // Current directory
   char name[16];                     // Process name (debugging)
+  void (*kfn)(void);                 // Kernel thread body (see kthread())
+  int plugged;                       // Block I/O plug depth (see bplug())
+  struct buf *plughead;              // Block I/O held back while plugged
+  struct buf *plugtail;
+  int logresv;                       // Log blocks the FS op reserved
+  int logused;                       // Log blocks the FS op has used
   #ifdef LAB_SYSCALL
   uint64 trace_mask;                 // Trace mask
   #endif
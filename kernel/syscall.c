@@ -101,6 +101,14 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_fadvise(void);
+extern uint64 sys_iostat(void);
+extern uint64 sys_iotune(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_sync(void);
+extern uint64 sys_getdents(void);
+extern uint64 sys_fstatat(void);
+extern uint64 sys_dirstat(void);
 #ifdef LAB_SYSCALL
 extern uint64 sys_trace(void);
 extern uint64 sys_sysinfo(void);
@@ -147,6 +155,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_fadvise] sys_fadvise,
+[SYS_iostat]  sys_iostat,
+[SYS_iotune]  sys_iotune,
+[SYS_fsync]   sys_fsync,
+[SYS_sync]    sys_sync,
+[SYS_getdents] sys_getdents,
+[SYS_fstatat]  sys_fstatat,
+[SYS_dirstat]  sys_dirstat,
 #ifdef LAB_SYSCALL
 [SYS_trace]   sys_trace,
 [SYS_sysinfo] sys_sysinfo,
@@ -194,6 +210,14 @@ static const char* syscall_names[] = {
   [SYS_link]    "link",
   [SYS_mkdir]   "mkdir",
   [SYS_close]   "close",
+  [SYS_fadvise] "fadvise",
+  [SYS_iostat]  "iostat",
+  [SYS_iotune]  "iotune",
+  [SYS_fsync]   "fsync",
+  [SYS_sync]    "sync",
+  [SYS_getdents] "getdents",
+  [SYS_fstatat]  "fstatat",
+  [SYS_dirstat]  "dirstat",
   #ifdef LAB_SYSCALL
   [SYS_trace]   "trace",
   [SYS_sysinfo] "sysinfo",
@@ -231,7 +255,7 @@ syscall(void)
     p->trapframe->a0 = syscalls[num]();
     #ifdef LAB_SYSCALL
     // if traced, print syscall name and return value
-    if(p->trace_mask & (1 << num)) {
+    if(p->trace_mask & (1UL << num)) {
       printf("%d: syscall %s -> %d\n", p->pid, syscall_names[num], p->trapframe->a0);
     }
     #endif
@@ -31,3 +31,13 @@
 #define SYS_munmap    28
 #define SYS_connect   29
 #define SYS_pgaccess  30
+
+// File system extensions
+#define SYS_fadvise   31
+#define SYS_iostat    32
+#define SYS_iotune    33
+#define SYS_fsync     34
+#define SYS_sync      35
+#define SYS_getdents  36
+#define SYS_fstatat   37
+#define SYS_dirstat   38
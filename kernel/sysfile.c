@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "iostat.h"
 #ifdef LAB_MMAP
 #include "memlayout.h"
 #endif
@@ -106,8 +107,7 @@ sys_close(void)
   if(argfd(0, &fd, &f) < 0)
     return -1;
   myproc()->ofile[fd] = 0;
-  fileclose(f);
-  return 0;
+  return fileclose(f);
 }
 
 uint64
@@ -132,7 +132,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op_n(2*LOG_LOOKUP + 1 + LOG_DIRLINK);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -176,14 +176,18 @@ bad:
 static int
 isdirempty(struct inode *dp)
 {
-  int off;
-  struct dirent de;
+  struct dirblk db;
+  int i;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
+  db.off = 2*sizeof(struct dirent);
+  db.bp = 0;
+  while(dirnext(dp, &db)){
+    for(i = 0; i < db.n; i++){
+      if(db.de[i].inum != 0){
+        dirdone(&db);
+        return 0;
+      }
+    }
   }
   return 1;
 }
@@ -199,7 +203,8 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  // the entry's block, the directory's i-node, and ip.
+  begin_op_n(LOG_LOOKUP + 2 + LOG_IPUT);
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -225,6 +230,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcenter(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -265,7 +271,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -317,7 +323,14 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  n = (omode & O_CREATE) ? LOG_CREATE : LOG_LOOKUP;
+  #ifdef LAB_FS
+  if(!(omode & O_NOFOLLOW))
+    n += LOG_LOOKUP;  // a removed symbolic link
+  #endif
+  if(omode & O_TRUNC)
+    n += LOG_IPUT;
+  begin_op_n(n);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -383,6 +396,8 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    memset(&f->ra, 0, sizeof(f->ra));
+    f->ra.prev = -1;  // so that a first read at offset 0 counts as sequential
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -404,7 +419,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op_n(LOG_CREATE);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -421,7 +436,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op_n(LOG_CREATE);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -441,7 +456,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
 
-  begin_op();
+  begin_op_n(2*LOG_LOOKUP);  // the old cwd may be a removed directory
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -532,6 +547,178 @@ sys_pipe(void)
   return 0;
 }
 
+// Give the kernel a hint about how a file will be read.
+uint64
+sys_fadvise(void)
+{
+  struct file *f;
+  int off, len, advice;
+
+  argint(1, &off);
+  argint(2, &len);
+  argint(3, &advice);
+  if(argfd(0, 0, &f) < 0 || off < 0 || len < 0)
+    return -1;
+  return fileadvise(f, off, len, advice);
+}
+
+// Copy as many of the entries in use of directory fd as fit
+// in n bytes to buf, as struct dirents, starting at the file
+// offset. Returns the number of bytes copied, 0 at the end.
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  uint64 p;
+  int n, r;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE || f->readable == 0 || n < (int)sizeof(struct dirent))
+    return -1;
+  ilock(f->ip);
+  if(f->ip->type != T_DIR){
+    iunlock(f->ip);
+    return -1;
+  }
+  r = getdents(f->ip, p, &f->off, n);
+  iunlock(f->ip);
+  return r;
+}
+
+// fstat() of path, relative to directory fd unless absolute.
+// A symbolic link is not followed.
+uint64
+sys_fstatat(void)
+{
+  char path[MAXPATH];
+  struct file *f;
+  struct inode *ip;
+  struct stat st;
+  uint64 addr; // user pointer to struct stat
+
+  argaddr(2, &addr);
+  if(argfd(0, 0, &f) < 0 || argstr(1, path, MAXPATH) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  begin_op_n(LOG_LOOKUP + LOG_IPUT);  // ip may have been removed
+  if((ip = nameiat(f->ip, path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  stati(ip, &st);
+  iunlockput(ip);
+  end_op();
+  return copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st));
+}
+
+// Stat the n entries of directory fd at de, as getdents()
+// returned them, into the n struct stats at st, looking each
+// up by name. An entry since removed gets a type of 0.
+uint64
+sys_dirstat(void)
+{
+  struct file *f;
+  struct inode *dp, *ip;
+  struct dirent de;
+  struct stat st;
+  uint64 deaddr, staddr;
+  int n, i;
+
+  argaddr(1, &deaddr);
+  argint(2, &n);
+  argaddr(3, &staddr);
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  dp = f->ip;
+  for(i = 0; i < n; i++){
+    if(copyin(myproc()->pagetable, (char *)&de, deaddr + i*sizeof(de), sizeof(de)) < 0)
+      return -1;
+    begin_op_n(LOG_IPUT);  // ip may have been removed
+    ilock(dp);
+    if(dp->type != T_DIR){
+      iunlock(dp);
+      end_op();
+      return -1;
+    }
+    ip = dirlookup(dp, de.name, 0);
+    iunlock(dp);
+    memset(&st, 0, sizeof(st));
+    if(ip){
+      ilock(ip);
+      stati(ip, &st);
+      iunlockput(ip);
+    }
+    end_op();
+    if(copyout(myproc()->pagetable, staddr + i*sizeof(st), (char *)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Wait until the changes to a file are on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+// Wait until all file system changes so far are on disk.
+uint64
+sys_sync(void)
+{
+  iflushall();
+  log_force(log_seq());
+  return 0;
+}
+
+// Copy the block I/O statistics to user space.
+uint64
+sys_iostat(void)
+{
+  uint64 addr; // user pointer to struct iostat
+
+  argaddr(0, &addr);
+  return copyout(myproc()->pagetable, addr, (char *)&iostat, sizeof(iostat));
+}
+
+// Set block I/O parameter param to value, unless value is -1.
+// Returns the old value.
+uint64
+sys_iotune(void)
+{
+  int param, value, old;
+
+  argint(0, &param);
+  argint(1, &value);
+  switch(param){
+  case IOT_SCHED:
+    return elv_sched(value);
+  case IOT_POLL:
+    return virtio_disk_poll(value);
+  case IOT_ASYNC:
+    return log_async(value);
+  case IOT_ORDERED:
+    old = log_ordered(value);
+    if(value == 0)
+      iflushall();  // writei() delays blocks only in ordered mode
+    return old;
+  case IOT_FIXEDRSV:
+    return log_fixedrsv(value);
+  case IOT_DELALLOC:
+    return delalloc(value);
+  }
+  return -1;
+}
+
 #ifdef LAB_FS
 uint64
 sys_symlink(void)
@@ -541,7 +728,7 @@ sys_symlink(void)
     return -1;
   }
 
-  begin_op();
+  begin_op_n(LOG_CREATE + LOG_GROW);
   struct inode *ip = create(path, T_SYMLINK, 0, 0);
   if(ip == 0) {
     end_op();
@@ -675,8 +862,18 @@ uint64 unmap(struct proc *p, uint64 addr, int length)
               bwrite(bp);
               brelse(bp);
             } else {
-              begin_op();
-              if(writei(p->mmap[i].fd->ip, 1, page_addr, p->mmap[i].offset + (page_addr - p->mmap[i].addr), PGSIZE) < 0) {
+              // A copied page, of an inline file or a delayed
+              // block: write back only what is inside the file,
+              // so that it doesn't grow.
+              struct inode *ip = p->mmap[i].fd->ip;
+              uint off = p->mmap[i].offset + (page_addr - p->mmap[i].addr);
+              uint n = off < ip->size ? ip->size - off : 0;
+              if(n > PGSIZE)
+                n = PGSIZE;
+              // in journal mode writei() writes the file's
+              // delayed blocks first.
+              begin_op_n(MAXOPBLOCKS + LOG_FLUSH);
+              if(writei(ip, 1, page_addr, off, n) < 0) {
                 iunlock(p->mmap[i].fd->ip);
                 end_op();
                 return -1;
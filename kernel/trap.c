@@ -46,8 +46,11 @@ mmapfault(struct proc *p, struct vma* mmap, uint64 va)
   uint64 pa;
   int perm = (mmap->prot << 1) | PTE_V | PTE_U;
   ilock(f->ip);
-  uint64 addr = bmap(f->ip, (mmap->offset + PGROUNDDOWN(va - mmap->addr)) / BSIZE);
-  struct buf *bp = bget(f->ip->dev, addr);
+  // An inline file, or a delayed block, has no block to map;
+  // copy its data instead.
+  uint bn = (mmap->offset + PGROUNDDOWN(va - mmap->addr)) / BSIZE;
+  uint64 addr = iinline(f->ip) || idelayed(f->ip, bn) ? 0 : bmap(f->ip, bn);
+  struct buf *bp = addr ? bget(f->ip->dev, addr) : 0;
 
   if(bp == 0) {
     pa = (uint64)kalloc();
@@ -288,6 +291,7 @@ clockintr()
   ticks++;
   wakeup(&ticks);
   release(&tickslock);
+  log_tick();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -29,6 +29,10 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
+
+// virtio-blk configuration space fields, from qemu virtio_blk.h
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES	34 // uint16, with VIRTIO_BLK_F_MQ
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -47,7 +51,11 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// each request takes three, so NUM/3 can be in flight.
+#define NUM 32
+
+// most blocks moved by one request with indirect descriptors.
+#define MAXSEG 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -58,13 +66,16 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // buffer holds a table of descriptors
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // driver does not need interrupts
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt once used.idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -74,10 +85,13 @@ struct virtq_used_elem {
   uint32 len;
 };
 
+#define VRING_USED_F_NO_NOTIFY 1 // device does not need notifications
+
 struct virtq_used {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_USED_F_NO_NOTIFY
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify once avail.idx passes this
 };
 
 // these are specific to virtio block devices, e.g. disks,
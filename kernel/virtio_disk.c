@@ -2,7 +2,11 @@
 // driver for qemu's virtio disk device.
 // uses qemu's mmio interface to virtio.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=3
+//
+// with VIRTIO_BLK_F_MQ, the device has several virtqueues, and
+// each hart submits to its own, so that harts doing I/O at the
+// same time do not contend for a single lock.
 //
 
 #include "types.h"
@@ -14,12 +18,17 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "elevator.h"
 #include "virtio.h"
+#include "iostat.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue, and the requests in it.
+struct vq {
+  struct spinlock lock;
+
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -53,17 +62,62 @@ static struct disk {
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
-  struct spinlock vdisk_lock;
-  
+
+  // indirect descriptor tables, one per possible chain head,
+  // for requests that move several adjacent blocks.
+  struct virtq_desc itable[NUM][MAXSEG+2] __attribute__((aligned(16)));
+
+  // submitted buffers waiting for descriptors,
+  // in the order the I/O scheduler chooses.
+  struct ioqueue queue;
+  int inflight;      // requests posted to the avail ring
+  uint16 notified;   // avail->idx when we last notified the device
+  int polling;       // processes polling the used ring
+};
+
+static struct disk {
+  struct vq vq[NVQ];
+  int nvq;           // virtqueues in use
+
+  int indirect;      // VIRTIO_RING_F_INDIRECT_DESC negotiated?
+  int event_idx;     // VIRTIO_RING_F_EVENT_IDX negotiated?
+  int pollus;        // how long virtio_disk_wait() polls, in microseconds
 } disk;
 
+#ifdef LAB_LOCK
+//
+// check that there are at most NBUF distinct
+// struct buf's, which the lock lab requires.
+//
+static struct spinlock xbufs_lock;
+static struct buf *xbufs[NBUF];
+static void
+checkbuf(struct buf *b)
+{
+  acquire(&xbufs_lock);
+  for(int i = 0; i < NBUF; i++){
+    if(xbufs[i] == b){
+      release(&xbufs_lock);
+      return;
+    }
+    if(xbufs[i] == 0){
+      xbufs[i] = b;
+      release(&xbufs_lock);
+      return;
+    }
+  }
+  panic("more than NBUF bufs");
+}
+#endif
+
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+#ifdef LAB_LOCK
+  initlock(&xbufs_lock, "checkbuf");
+#endif
 
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
@@ -71,7 +125,7 @@ virtio_disk_init(void)
      *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
     panic("could not find virtio disk");
   }
-  
+
   // reset device
   *R(VIRTIO_MMIO_STATUS) = status;
 
@@ -88,10 +142,11 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep VIRTIO_BLK_F_MQ, VIRTIO_RING_F_INDIRECT_DESC and
+  // VIRTIO_RING_F_EVENT_IDX if the device offers them.
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -103,47 +158,64 @@ virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // one virtqueue per hart, as far as the device allows.
+  disk.nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nvq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+  if(disk.nvq > NVQ)
+    disk.nvq = NVQ;
+  if(disk.nvq > NCPU)
+    disk.nvq = NCPU;
+  if(disk.nvq < 1)
+    disk.nvq = 1;
+
+  for(int q = 0; q < disk.nvq; q++){
+    struct vq *vq = &disk.vq[q];
+
+    initlock(&vq->lock, "virtio_disk");
+
+    // initialize queue q.
+    *R(VIRTIO_MMIO_QUEUE_SEL) = q;
+
+    // ensure queue q is not in use.
+    if(*R(VIRTIO_MMIO_QUEUE_READY))
+      panic("virtio disk should not be ready");
+
+    // check maximum queue size.
+    uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if(max == 0)
+      panic("virtio disk has no queue");
+    if(max < NUM)
+      panic("virtio disk max queue too short");
+
+    // allocate and zero queue memory.
+    vq->desc = kalloc();
+    vq->avail = kalloc();
+    vq->used = kalloc();
+    if(!vq->desc || !vq->avail || !vq->used)
+      panic("virtio disk kalloc");
+    memset(vq->desc, 0, PGSIZE);
+    memset(vq->avail, 0, PGSIZE);
+    memset(vq->used, 0, PGSIZE);
+
+    // set queue size.
+    *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+    // write physical addresses.
+    *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)vq->desc;
+    *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)vq->desc >> 32;
+    *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)vq->avail;
+    *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)vq->avail >> 32;
+    *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)vq->used;
+    *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)vq->used >> 32;
+
+    // queue is ready.
+    *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+    // all NUM descriptors start out unused.
+    for(int i = 0; i < NUM; i++)
+      vq->free[i] = 1;
+  }
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -154,11 +226,11 @@ virtio_disk_init(void)
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +239,27 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -199,129 +270,322 @@ free_chain(int i)
 // allocate three descriptors (they need not be contiguous).
 // disk transfers always use three descriptors.
 static int
-alloc3_desc(int *idx)
+alloc3_desc(struct vq *vq, int *idx)
 {
   for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-#ifdef LAB_LOCK
-//
-// check that there are at most NBUF distinct
-// struct buf's, which the lock lab requires.
-//
-static struct buf *xbufs[NBUF];
+// move queued buffers into vq's avail ring, as many as there
+// are descriptors and in-flight slots for. with indirect
+// descriptors, the I/O scheduler may merge buffers for adjacent
+// blocks into a single request, linked through buf.ionext.
+// the device is not told about the new requests until
+// virtio_disk_notify().
+// caller must hold vq->lock.
 static void
-checkbuf(struct buf *b)
+virtio_disk_post(struct vq *vq)
 {
-  for(int i = 0; i < NBUF; i++){
-    if(xbufs[i] == b){
-      return;
+  struct buf *b, *x;
+  int idx[3], head, nseg, i;
+  uint16 avail_idx = vq->avail->idx;
+  uint64 m;
+
+  while(vq->queue.head != 0 && vq->inflight < NUM/3){
+    if(disk.indirect){
+      if((head = alloc_desc(vq)) < 0)
+        break;
+    } else {
+      // the spec's Section 5.2 says that legacy block operations use
+      // three descriptors: one for type/reserved/sector, one for the
+      // data, one for a 1-byte status result.
+      if(alloc3_desc(vq, idx) != 0)
+        break;
+      head = idx[0];
     }
-    if(xbufs[i] == 0){
-      xbufs[i] = b;
-      return;
+
+    b = elv_next(&vq->queue, disk.indirect ? MAXSEG : 1);
+    for(nseg = 0, x = b; x != 0; x = x->ionext)
+      nseg++;
+
+    // format the request header.
+    // qemu's virtio-blk.c reads it.
+
+    struct virtio_blk_req *buf0 = &vq->ops[head];
+
+    if(b->iowrite)
+      buf0->type = VIRTIO_BLK_T_OUT; // write the disk
+    else
+      buf0->type = VIRTIO_BLK_T_IN; // read the disk
+    buf0->reserved = 0;
+    buf0->sector = b->ioblock * (BSIZE / 512);
+    vq->info[head].status = 0xff; // device writes 0 on success
+
+    if(disk.indirect){
+      // the head descriptor points to a table holding the
+      // header, one descriptor per block, and the status.
+      struct virtq_desc *t = vq->itable[head];
+
+      t[0].addr = (uint64) buf0;
+      t[0].len = sizeof(struct virtio_blk_req);
+      t[0].flags = VRING_DESC_F_NEXT;
+      t[0].next = 1;
+      for(i = 1, x = b; x != 0; i++, x = x->ionext){
+        t[i].addr = (uint64) x->data;
+        t[i].len = BSIZE;
+        t[i].flags = b->iowrite ? 0 : VRING_DESC_F_WRITE;
+        t[i].flags |= VRING_DESC_F_NEXT;
+        t[i].next = i + 1;
+      }
+      t[i].addr = (uint64) &vq->info[head].status;
+      t[i].len = 1;
+      t[i].flags = VRING_DESC_F_WRITE; // device writes the status
+      t[i].next = 0;
+
+      vq->desc[head].addr = (uint64) t;
+      vq->desc[head].len = (nseg + 2) * sizeof(struct virtq_desc);
+      vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+      vq->desc[head].next = 0;
+    } else {
+      // format the three descriptors.
+      vq->desc[idx[0]].addr = (uint64) buf0;
+      vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+      vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+      vq->desc[idx[0]].next = idx[1];
+
+      vq->desc[idx[1]].addr = (uint64) b->data;
+      vq->desc[idx[1]].len = BSIZE;
+      if(b->iowrite)
+        vq->desc[idx[1]].flags = 0; // device reads b->data
+      else
+        vq->desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+      vq->desc[idx[1]].flags |= VRING_DESC_F_NEXT;
+      vq->desc[idx[1]].next = idx[2];
+
+      vq->desc[idx[2]].addr = (uint64) &vq->info[head].status;
+      vq->desc[idx[2]].len = 1;
+      vq->desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
+      vq->desc[idx[2]].next = 0;
     }
+
+    // record struct buf for virtio_disk_intr().
+    vq->info[head].b = b;
+    vq->inflight++;
+    // other queues update the maximum under their own locks.
+    for(m = iostat.maxinflight; vq->inflight > m; m = iostat.maxinflight)
+      if(__sync_bool_compare_and_swap(&iostat.maxinflight, m, vq->inflight))
+        break;
+    __sync_fetch_and_add(&iostat.nreq, 1);
+    if(b->iowrite)
+      __sync_fetch_and_add(&iostat.nwrite, nseg);
+    else
+      __sync_fetch_and_add(&iostat.nread, nseg);
+
+    // the first index in our chain of descriptors.
+    vq->avail->ring[avail_idx % NUM] = head;
+    avail_idx++;
   }
-  panic("more than NBUF bufs");
+
+  __sync_synchronize();
+
+  // publish all the new avail ring entries at once.
+  vq->avail->idx = avail_idx; // not % NUM ...
+
+  __sync_synchronize();
 }
-#endif
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// with VIRTIO_RING_F_EVENT_IDX, has idx moved past event,
+// on its way from old to new? from the spec.
+static int
+need_event(uint16 event, uint16 new, uint16 old)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
 
-  acquire(&disk.vdisk_lock);
+// tell the device about avail ring entries of vq it has
+// not been told about yet, with a single notification.
+// caller must hold vq->lock.
+static void
+virtio_disk_notify(struct vq *vq)
+{
+  uint16 old = vq->notified;
 
-#ifdef LAB_LOCK
-  checkbuf(b);
-#endif
+  virtio_disk_post(vq);
+  if(old == vq->avail->idx)
+    return;
+  vq->notified = vq->avail->idx;
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // the device asks not to be notified while it is
+  // already working through the avail ring.
+  if(disk.event_idx){
+    if(!need_event(vq->used->avail_event, vq->avail->idx, old))
+      return;
+  } else if(vq->used->flags & VRING_USED_F_NO_NOTIFY){
+    return;
+  }
 
-  // allocate the three descriptors.
-  int idx[3];
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = vq - disk.vq; // value is queue number
+  __sync_fetch_and_add(&iostat.nnotify, 1);
+}
+
+// finish the requests the device has put in vq's used ring,
+// then post queued requests that the freed descriptors make
+// room for. with VIRTIO_RING_F_EVENT_IDX, the device raises one
+// interrupt for a burst of completions we have not yet seen.
+// while someone polls, the device need not interrupt at all.
+// caller must hold vq->lock.
+static void
+virtio_disk_complete(struct vq *vq)
+{
   while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
+    // the device increments vq->used->idx when it
+    // adds an entry to the used ring.
+    while(vq->used_idx != vq->used->idx){
+      __sync_synchronize();
+      int id = vq->used->ring[vq->used_idx % NUM].id;
+
+      if(vq->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      struct buf *b = vq->info[id].b;
+      vq->info[id].b = 0;
+      free_chain(vq, id);
+      vq->inflight--;
+
+      while(b){
+        // iodone may hand b to someone else.
+        struct buf *next = b->ionext;
+        elv_done(b);
+        b->disk = 0;   // disk is done with buf
+        if(b->iodone)
+          b->iodone(b);
+        else
+          wakeup(b);
+        b = next;
+      }
+
+      vq->used_idx += 1;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+
+    // ask for an interrupt at the next completion, unless polling,
+    // and check for a completion that raced with the request.
+    if(disk.event_idx)
+      vq->avail->used_event = vq->used_idx - (vq->polling ? 1 : 0);
+    else
+      vq->avail->flags = vq->polling ? VRING_AVAIL_F_NO_INTERRUPT : 0;
+    __sync_synchronize();
+    if(vq->used_idx == vq->used->idx)
+      break;
   }
 
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
-
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
-
-  if(write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
-  buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // the freed descriptors may let queued requests start.
+  virtio_disk_notify(vq);
+}
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+// queue a disk operation on locked buffer b, and return
+// without waiting for it. the device is not told about it
+// until virtio_disk_kick() or virtio_disk_wait(), so that
+// the I/O scheduler can order and merge the operations
+// queued in between.
+// the operation goes to the calling hart's virtqueue, whose
+// number is returned for virtio_disk_kick(); the caller may
+// have moved to another hart since.
+// if done is non-zero, virtio_disk_intr() calls done(b) when
+// the operation has finished; done runs in interrupt context
+// with the queue lock held, so it must neither sleep nor
+// submit more disk operations.
+// otherwise use virtio_disk_wait(b) to wait for it.
+int
+virtio_disk_submit(struct buf *b, int write, void (*done)(struct buf *))
+{
+  struct vq *vq;
+  int q;
 
-  __sync_synchronize();
+#ifdef LAB_LOCK
+  checkbuf(b);
+#endif
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  push_off();
+  q = cpuid() % disk.nvq;
+  pop_off();
+  vq = &disk.vq[q];
 
-  __sync_synchronize();
+  acquire(&vq->lock);
+  b->iovq = q;
+  b->disk = 1;
+  b->iowrite = write;
+  b->iodone = done;
+  elv_add(&vq->queue, b);
+  release(&vq->lock);
+  return q;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// tell the device about all operations submitted to the
+// virtqueues in the bit mask vqs.
+void
+virtio_disk_kick(uint vqs)
+{
+  struct vq *vq;
+  int q;
+
+  for(q = 0; q < disk.nvq; q++){
+    if((vqs & (1 << q)) == 0)
+      continue;
+    vq = &disk.vq[q];
+    acquire(&vq->lock);
+    virtio_disk_notify(vq);
+    release(&vq->lock);
+  }
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// wait for the disk to finish the operation on b,
+// which must have been submitted without a callback.
+// if polling is enabled, first spin on the used ring for up
+// to disk.pollus microseconds, which saves an interrupt and
+// a sleep/wakeup for a short operation.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct vq *vq = &disk.vq[b->iovq];
+
+  acquire(&vq->lock);
+  virtio_disk_notify(vq);
+  if(b->disk == 1 && disk.pollus > 0){
+    uint64 end = r_time() + disk.pollus * (CLINT_FREQ / 1000000);
+    vq->polling++;
+    while(b->disk == 1 && r_time() < end){
+      if(vq->used_idx != vq->used->idx){
+        virtio_disk_complete(vq);
+      } else {
+        // let other harts at the queue.
+        release(&vq->lock);
+        acquire(&vq->lock);
+      }
+    }
+    vq->polling--;
+    virtio_disk_complete(vq); // re-enables interrupts if no one polls
+    if(b->disk == 0)
+      __sync_fetch_and_add(&iostat.npolled, 1);
+  }
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &vq->lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
-  release(&disk.vdisk_lock);
+  release(&vq->lock);
 }
 
+// the device has one interrupt for all its virtqueues;
+// each queue's completions are finished under its own lock,
+// and wake up the processes that wait for them.
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -332,22 +596,24 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  __sync_fetch_and_add(&iostat.nintr, 1);
+  for(int q = 0; q < disk.nvq; q++){
+    struct vq *vq = &disk.vq[q];
+    acquire(&vq->lock);
+    virtio_disk_complete(vq);
+    release(&vq->lock);
   }
+}
+
+// set how long virtio_disk_wait() polls before it sleeps,
+// in microseconds, if us >= 0; 0 turns polling off.
+// returns the old setting.
+int
+virtio_disk_poll(int us)
+{
+  int old = disk.pollus;
 
-  release(&disk.vdisk_lock);
+  if(us >= 0)
+    disk.pollus = us;
+  return old;
 }
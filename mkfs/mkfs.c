@@ -22,10 +22,13 @@
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// or with -g
+// [ boot block | sb block | log | group 0 | group 1 | ... ]
+// where each group is [ free bit map | inode blocks | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = 2 * (LOGSIZE+1);  // two regions, each a header and LOGSIZE blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -34,15 +37,23 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+int extents;  // -e: map i-node blocks with extents
+int groups;   // -g: lay the disk out in block groups
+int htree;    // -h: index directories over a block
+int inlined;  // -i: keep small files' data in their i-nodes
+int ngmeta;   // Number of meta blocks per group (bitmap, inode)
 
 
 void balloc(int);
+uint newblock(void);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint ebmap(struct dinode *din, uint fbn);
 void iappend(uint inum, void *p, int n);
+void dxindex(uint inum, uint parent, struct dirent *de, int n);
 void die(const char *);
 
 // convert to riscv byte order
@@ -73,20 +84,34 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
+  struct dirent de, *ents;
   char buf[BSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for(; argc >= 2 && argv[1][0] == '-'; argc--, argv++){
+    if(strcmp(argv[1], "-e") == 0)
+      extents = 1;
+    else if(strcmp(argv[1], "-g") == 0)
+      groups = 1;
+    else if(strcmp(argv[1], "-h") == 0)
+      htree = 1;
+    else if(strcmp(argv[1], "-i") == 0)
+      inlined = 1;
+    else
+      break;
+  }
+  if(argc < 2 || argv[1][0] == '-'){
+    fprintf(stderr, "Usage: mkfs [-e] [-g] [-h] [-i] fs.img files...\n");
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(NEXTENT * sizeof(struct extent) + sizeof(uint) <= sizeof(din.addrs));
+  assert(INLINESZ == sizeof(din.addrs));
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
@@ -104,11 +129,38 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
-
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
-
-  freeblock = nmeta;     // the first free block that we can allocate
+  sb.features = xint((extents ? FS_EXTENTS : 0) | (htree ? FS_HTREE : 0) |
+                     (inlined ? FS_INLINE : 0));
+
+  if(groups){
+    // Split the blocks after the log into groups of BPG, each
+    // with a bitmap block and a share of the inodes, dropping a
+    // last group too small for more than its own metadata.
+    sb.gstart = xint(2+nlog);
+    sb.bpg = xint(BPG);
+    sb.ngroups = xint((FSSIZE - (2+nlog) + BPG - 1) / BPG);
+    sb.ipg = xint(((NINODES + sb.ngroups - 1) / sb.ngroups + IPB - 1) / IPB * IPB);
+    ngmeta = 1 + sb.ipg / IPB;
+    if(FSSIZE - GSTART(sb.ngroups - 1, sb) <= ngmeta){
+      sb.ngroups = xint(sb.ngroups - 1);
+      sb.size = xint(GSTART(sb.ngroups, sb));
+    }
+    assert(sb.ngroups <= NBITMAP);
+    sb.ninodes = xint(sb.ngroups * sb.ipg);
+    sb.inodestart = xint(sb.gstart + 1);
+    sb.bmapstart = xint(sb.gstart);
+    sb.features = xint(sb.features | FS_GROUPS);
+    nmeta = 2 + nlog + sb.ngroups * ngmeta;
+    nblocks = sb.size - nmeta;
+    sb.nblocks = xint(nblocks);
+    printf("nmeta %d (boot, super, log blocks %u, %u groups of %u blocks with %u inodes) blocks %d total %d\n",
+           nmeta, nlog, sb.ngroups, sb.bpg, sb.ipg, nblocks, sb.size);
+    freeblock = sb.gstart + ngmeta;
+  } else {
+    printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
+           nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+    freeblock = nmeta;     // the first free block that we can allocate
+  }
 
   for(i = 0; i < FSSIZE; i++)
     wsect(i, zeroes);
@@ -130,6 +182,8 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
+  if((ents = calloc(argc, sizeof(*ents))) == 0)
+    die("calloc");
   for(i = 2; i < argc; i++){
     // get rid of "user/"
     char *shortname;
@@ -156,19 +210,33 @@ main(int argc, char *argv[])
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
     iappend(rootino, &de, sizeof(de));
-
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+    ents[i-2] = de;
+
+    if(inlined && (cc = lseek(fd, 0, SEEK_END)) <= INLINESZ){
+      rinode(inum, &din);
+      if(lseek(fd, 0, SEEK_SET) != 0 || read(fd, din.addrs, cc) != cc)
+        die(argv[i]);
+      din.size = xint(cc);
+      winode(inum, &din);
+    } else {
+      lseek(fd, 0, SEEK_SET);
+      while((cc = read(fd, buf, sizeof(buf))) > 0)
+        iappend(inum, buf, cc);
+    }
 
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(htree && argc > DPB){
+    dxindex(rootino, rootino, ents, argc - 2);
+  } else {
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
@@ -238,9 +306,24 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, g, n;
 
   printf("balloc: first %d blocks have been allocated\n", used);
+  if(groups){
+    // Each group's blocks below used, and its metadata, are in use.
+    for(g = 0; g < sb.ngroups; g++){
+      n = used - (int)GSTART(g, sb);
+      if(n < ngmeta)
+        n = ngmeta;
+      if(n > sb.bpg)
+        n = sb.bpg;
+      bzero(buf, BSIZE);
+      for(i = 0; i < n; i++)
+        buf[i/8] = buf[i/8] | (0x1 << (i%8));
+      wsect(GSTART(g, sb), buf);
+    }
+    return;
+  }
   assert(used < BSIZE*8);
   bzero(buf, BSIZE);
   for(i = 0; i < used; i++){
@@ -252,6 +335,65 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// The next free block, skipping the metadata at the start of
+// each block group.
+uint
+newblock(void)
+{
+  if(groups && (freeblock - sb.gstart) % sb.bpg == 0)
+    freeblock += ngmeta;
+  assert(freeblock < sb.size);
+  return freeblock++;
+}
+
+// Block fbn of an extent-mapped i-node. iappend() asks for the
+// blocks in order, so a missing one goes at the end, in the last
+// extent if the next free block follows it on the disk.
+uint
+ebmap(struct dinode *din, uint fbn)
+{
+  struct extent *e = (struct extent*)din->addrs, *last = 0;
+  char ebuf[BSIZE];
+  struct extblock *eb = (struct extblock*)ebuf;
+  uint ebaddr = xint(din->addrs[EXTBLK]);
+  uint i, n, b;
+
+  for(n = 0; n < NEXTENT && xint(e[n].len); n++)
+    ;
+  if(ebaddr){
+    assert(n == NEXTENT);
+    rsect(ebaddr, ebuf);
+    n += xint(eb->n);
+  }
+  for(i = 0; i < n; i++){
+    last = i < NEXTENT ? &e[i] : &eb->e[i - NEXTENT];
+    if(fbn - xint(last->lstart) < xint(last->len))
+      return xint(last->pstart) + fbn - xint(last->lstart);
+  }
+  assert(last == 0 || xint(last->lstart) + xint(last->len) == fbn);
+
+  b = newblock();
+  if(last && xint(last->pstart) + xint(last->len) == b){
+    last->len = xint(xint(last->len) + 1);
+  } else {
+    assert(n < NEXTENT + NEXTBLK);
+    if(n == NEXTENT){
+      ebaddr = newblock();
+      din->addrs[EXTBLK] = xint(ebaddr);
+      bzero(ebuf, BSIZE);
+    }
+    last = n < NEXTENT ? &e[n] : &eb->e[n - NEXTENT];
+    last->lstart = xint(fbn);
+    last->pstart = xint(b);
+    last->len = xint(1);
+    if(n >= NEXTENT)
+      eb->n = xint(n + 1 - NEXTENT);
+  }
+  if(ebaddr)
+    wsect(ebaddr, ebuf);
+  return b;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -268,18 +410,20 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = ebmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+        din.addrs[fbn] = xint(newblock());
       }
       x = xint(din.addrs[fbn]);
     } else {
       if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+        din.addrs[NDIRECT] = xint(newblock());
       }
       rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
+        indirect[fbn - NDIRECT] = xint(newblock());
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
@@ -296,6 +440,77 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+int
+dxcmp(const void *a, const void *b)
+{
+  uint ha = dxhash(((struct dirent*)a)->name);
+  uint hb = dxhash(((struct dirent*)b)->name);
+
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Rewrite directory inum, whose parent is parent, with the n
+// entries de besides "." and "..", as an indexed directory. The
+// entries are sorted by hash, and fill each leaf block to three
+// quarters, leaving room for later ones, without splitting names
+// with the same hash between blocks.
+void
+dxindex(uint inum, uint parent, struct dirent *de, int n)
+{
+  char rbuf[BSIZE], buf[BSIZE];
+  struct dxroot *r = (struct dxroot*)rbuf;
+  struct dinode din;
+  int i, k, nleaf, start[NDXENTRY+1];
+
+  qsort(de, n, sizeof(*de), dxcmp);
+  for(i = nleaf = 0; i < n; i += k){
+    if(nleaf == NDXENTRY)
+      die("dxindex: directory too large");
+    start[nleaf++] = i;
+    k = n - i < DPB - DPB/4 ? n - i : DPB - DPB/4;
+    while(i + k < n && k > 0 && dxhash(de[i+k].name) == dxhash(de[i+k-1].name))
+      k--;
+    if(k == 0)
+      die("dxindex: too many names with one hash");
+  }
+  start[nleaf] = n;
+
+  memset(rbuf, 0, BSIZE);
+  r->dot.inum = xshort(inum);
+  strcpy(r->dot.name, ".");
+  r->dotdot.inum = xshort(parent);
+  strcpy(r->dotdot.name, "..");
+  r->magic = xint(DXMAGIC);
+  r->n = xint(nleaf);
+  for(i = 0; i < nleaf; i++){
+    r->e[i].hash = xint(i == 0 ? 0 : dxhash(de[start[i]].name));
+    r->e[i].block = xint(i + 1);
+  }
+
+  // Reuse the directory's blocks, from the start.
+  rinode(inum, &din);
+  din.size = 0;
+  winode(inum, &din);
+  iappend(inum, rbuf, BSIZE);
+  for(i = 0; i < nleaf; i++){
+    memset(buf, 0, BSIZE);
+    memmove(buf, de + start[i], (start[i+1] - start[i]) * sizeof(*de));
+    iappend(inum, buf, BSIZE);
+  }
+}
+
 void
 die(const char *s)
 {
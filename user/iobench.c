@@ -0,0 +1,391 @@
+//
+// Block I/O benchmark: several processes write, and then read back,
+// a file each at the same time, once under each I/O scheduler,
+// once with polled completion, and once with file data going
+// through the log rather than ordered mode. Reports blocks moved,
+// disk requests, disk interrupts, log commits and FS system calls
+// per commit, elapsed ticks, and the 99th-percentile
+// queue-to-completion latency of a block.
+//
+// iobench -s instead reads with 1 to MAXPROC processes at once,
+// to show how block I/O scales with the number of harts.
+//
+// iobench -c runs MAXPROC processes that open and close a file,
+// or create and unlink one, first with every FS system call
+// reserving MAXOPBLOCKS log blocks and then with each reserving
+// what it needs, and reports how many ran in a transaction at
+// once on average, and how often one waited for log space.
+//
+// iobench -i creates NCREATE files in a directory and then
+// removes them, and reports the blocks the kernel looked up
+// (cached or not) and read from disk per file.
+//
+// iobench -a runs MAXPROC processes that each append to a file
+// a little at a time, without and then with delayed allocation,
+// and reports blocks written, disk requests, and log commits:
+// files whose blocks lie in a row take fewer requests.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/iostat.h"
+#include "user/user.h"
+
+#define NBLOCK 64   // blocks per file
+#define MAXPROC 8
+#define POLLUS 200  // microseconds to poll, when polling
+
+char buf[BSIZE];
+
+struct config {
+  char *name;
+  int sched;
+  int poll;
+  int ordered;
+} configs[] = {
+  { "noop", IOSCHED_NOOP, 0, 1 },
+  { "deadline", IOSCHED_DEADLINE, 0, 1 },
+  { "deadline+poll", IOSCHED_DEADLINE, POLLUS, 1 },
+  { "deadline+journal", IOSCHED_DEADLINE, 0, 0 },
+};
+
+void
+worker(int i, int writing)
+{
+  char path[] = "iobench0";
+  int fd, b;
+
+  path[7] += i;
+  fd = open(path, writing ? O_CREATE | O_WRONLY : O_RDONLY);
+  if(fd < 0){
+    fprintf(2, "iobench: cannot open %s\n", path);
+    exit(1);
+  }
+  for(b = 0; b < NBLOCK; b++){
+    if(writing){
+      memset(buf, i + b, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        fprintf(2, "iobench: write %s failed\n", path);
+        exit(1);
+      }
+    } else if(read(fd, buf, BSIZE) != BSIZE){
+      fprintf(2, "iobench: read %s failed\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+  exit(0);
+}
+
+// Smallest i such that 99% of the blocks in the
+// latency histogram took less than 2^i microseconds.
+int
+p99(struct iostat *before, struct iostat *after)
+{
+  uint64 total = 0, sum = 0;
+  int i;
+
+  for(i = 0; i < NIOLAT; i++)
+    total += after->lat[i] - before->lat[i];
+  for(i = 0; i < NIOLAT; i++){
+    sum += after->lat[i] - before->lat[i];
+    if(sum * 100 >= total * 99)
+      break;
+  }
+  return i;
+}
+
+// Run nproc workers at once, on files first, first+1, ...
+void
+run(char *name, int first, int nproc, int writing)
+{
+  struct iostat before, after;
+  int i, t0, t1, lat;
+  uint64 blocks, ncommit, opspercommit;
+
+  iostat(&before);
+  t0 = uptime();
+  for(i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "iobench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      worker((first + i) % MAXPROC, writing);
+  }
+  for(i = 0; i < nproc; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t1 = uptime();
+  iostat(&after);
+
+  if(writing)
+    blocks = after.nwrite - before.nwrite;
+  else
+    blocks = after.nread - before.nread;
+  lat = p99(&before, &after);
+  ncommit = after.ncommit - before.ncommit;
+  opspercommit = ncommit ? (after.nops - before.nops) / ncommit : 0;
+  printf("%s %s: %l blocks, %l requests, %l interrupts, %l commits, %l ops/commit, %d ticks, p99 latency < %l us\n",
+         name, writing ? "write" : "read", blocks, after.nreq - before.nreq,
+         after.nintr - before.nintr, ncommit, opspercommit, t1 - t0, 1UL << lat);
+}
+
+// Read with 1 to MAXPROC processes at once. Each run starts
+// with the files read longest ago, which are no longer cached.
+void
+scale(void)
+{
+  char label[] = "0 readers";
+  int n, first, i;
+
+  run("scale", 0, MAXPROC, 1);
+  first = 0;
+  for(n = 1; n <= MAXPROC; n++){
+    label[0] = '0' + n;
+    run(label, first, n, 0);
+    first = (first + n) % MAXPROC;
+  }
+  for(i = 0; i < MAXPROC; i++){
+    char path[] = "iobench0";
+    path[7] += i;
+    unlink(path);
+  }
+}
+
+#define NCONC 100  // FS system call pairs per process
+
+void
+concworker(int i)
+{
+  char path[] = "iobenchc0";
+  int j, fd;
+
+  path[8] += i;
+  for(j = 0; j < NCONC; j++){
+    if(i % 2 == 0){
+      fd = open("iobenchc", O_RDONLY);
+      close(fd);
+    } else {
+      fd = open(path, O_CREATE | O_WRONLY);
+      close(fd);
+      unlink(path);
+    }
+  }
+  exit(0);
+}
+
+void
+concurrency(void)
+{
+  struct iostat before, after;
+  int oldfixed, fixed, fd, i, t0, t1;
+
+  if((fd = open("iobenchc", O_CREATE | O_WRONLY)) < 0){
+    fprintf(2, "iobench: cannot create iobenchc\n");
+    exit(1);
+  }
+  close(fd);
+  oldfixed = iotune(IOT_FIXEDRSV, -1);
+  for(fixed = 1; fixed >= 0; fixed--){
+    if(iotune(IOT_FIXEDRSV, fixed) < 0){
+      fprintf(2, "iobench: cannot select reservations\n");
+      exit(1);
+    }
+    sync();
+    iostat(&before);
+    t0 = uptime();
+    for(i = 0; i < MAXPROC; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "iobench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        concworker(i);
+    }
+    for(i = 0; i < MAXPROC; i++){
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+    sync();
+    t1 = uptime();
+    iostat(&after);
+    printf("%s reservations: %l ops, %l at once on average, %l waits for log space, %d ticks\n",
+           fixed ? "MAXOPBLOCKS" : "per-op", after.nops - before.nops,
+           after.nops > before.nops ? (after.concur - before.concur) / (after.nops - before.nops) : 0,
+           after.nlogwait - before.nlogwait, t1 - t0);
+  }
+  iotune(IOT_FIXEDRSV, oldfixed);
+  unlink("iobenchc");
+}
+
+#define NCREATE 100
+
+// Create NCREATE files, or unlink them.
+void
+createrun(int creating)
+{
+  struct iostat before, after;
+  char path[] = "iobenchi/f00";
+  int i, fd, t0, t1;
+
+  iostat(&before);
+  t0 = uptime();
+  for(i = 0; i < NCREATE; i++){
+    path[10] = '0' + i / 10;
+    path[11] = '0' + i % 10;
+    if(!creating){
+      unlink(path);
+      continue;
+    }
+    if((fd = open(path, O_CREATE | O_WRONLY)) < 0){
+      fprintf(2, "iobench: cannot create %s\n", path);
+      exit(1);
+    }
+    close(fd);
+  }
+  t1 = uptime();
+  iostat(&after);
+  printf("%s %d files: %l block lookups and %l disk reads per file, %d ticks\n",
+         creating ? "create" : "unlink", NCREATE, (after.nbread - before.nbread) / NCREATE,
+         (after.nread - before.nread) / NCREATE, t1 - t0);
+}
+
+void
+creates(void)
+{
+  if(mkdir("iobenchi") < 0){
+    fprintf(2, "iobench: cannot mkdir iobenchi\n");
+    exit(1);
+  }
+  createrun(1);
+  createrun(0);
+  unlink("iobenchi");
+}
+
+#define NAPPEND 256  // bytes per append
+#define APPENDSZ (NBLOCK/4*BSIZE)  // bytes per file
+
+void
+appendworker(int i)
+{
+  char path[] = "iobencha0";
+  int fd, n;
+
+  path[8] += i;
+  if((fd = open(path, O_CREATE | O_TRUNC | O_WRONLY)) < 0){
+    fprintf(2, "iobench: cannot create %s\n", path);
+    exit(1);
+  }
+  memset(buf, i, NAPPEND);
+  for(n = 0; n < APPENDSZ; n += NAPPEND){
+    if(write(fd, buf, NAPPEND) != NAPPEND){
+      fprintf(2, "iobench: write %s failed\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+  exit(0);
+}
+
+void
+appends(void)
+{
+  struct iostat before, after;
+  int olddelay, delay, i, t0, t1;
+
+  olddelay = iotune(IOT_DELALLOC, -1);
+  for(delay = 0; delay < 2; delay++){
+    iotune(IOT_DELALLOC, delay);
+    sync();
+    iostat(&before);
+    t0 = uptime();
+    for(i = 0; i < MAXPROC; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "iobench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        appendworker(i);
+    }
+    for(i = 0; i < MAXPROC; i++){
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+    sync();
+    t1 = uptime();
+    iostat(&after);
+    printf("%s allocation: %l blocks, %l requests, %l commits, %d ticks\n",
+           delay ? "delayed" : "immediate", after.nwrite - before.nwrite,
+           after.nreq - before.nreq, after.ncommit - before.ncommit, t1 - t0);
+    for(i = 0; i < MAXPROC; i++){
+      char path[] = "iobencha0";
+      path[8] += i;
+      unlink(path);
+    }
+  }
+  iotune(IOT_DELALLOC, olddelay);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nproc = 4, oldsched, oldpoll, oldordered, c, i;
+
+  if(argc == 2 && strcmp(argv[1], "-s") == 0){
+    scale();
+    exit(0);
+  }
+  if(argc == 2 && strcmp(argv[1], "-c") == 0){
+    concurrency();
+    exit(0);
+  }
+  if(argc == 2 && strcmp(argv[1], "-i") == 0){
+    creates();
+    exit(0);
+  }
+  if(argc == 2 && strcmp(argv[1], "-a") == 0){
+    appends();
+    exit(0);
+  }
+  if(argc > 2 || (argc == 2 && (nproc = atoi(argv[1])) < 1) || nproc > MAXPROC){
+    fprintf(2, "Usage: iobench [-s | -c | -i | -a | nproc]\n");
+    exit(1);
+  }
+
+  oldsched = iotune(IOT_SCHED, -1);
+  oldpoll = iotune(IOT_POLL, -1);
+  oldordered = iotune(IOT_ORDERED, -1);
+  for(c = 0; c < sizeof(configs)/sizeof(configs[0]); c++){
+    if(iotune(IOT_SCHED, configs[c].sched) < 0 ||
+       iotune(IOT_POLL, configs[c].poll) < 0 ||
+       iotune(IOT_ORDERED, configs[c].ordered) < 0){
+      fprintf(2, "iobench: cannot select %s\n", configs[c].name);
+      exit(1);
+    }
+    run(configs[c].name, 0, nproc, 1);
+    run(configs[c].name, 0, nproc, 0);
+    for(i = 0; i < nproc; i++){
+      char path[] = "iobench0";
+      path[7] += i;
+      unlink(path);
+    }
+  }
+  iotune(IOT_SCHED, oldsched);
+  iotune(IOT_POLL, oldpoll);
+  iotune(IOT_ORDERED, oldordered);
+  exit(0);
+}
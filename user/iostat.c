@@ -0,0 +1,37 @@
+#include "kernel/types.h"
+#include "user/user.h"
+#include "kernel/iostat.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat st;
+
+  if(argc != 1){
+    fprintf(2, "Usage: iostat\nPrint block I/O statistics.\n");
+    exit(1);
+  }
+
+  if(iostat(&st) < 0){
+    fprintf(2, "iostat: failed\n");
+    exit(1);
+  }
+
+  printf("block lookups: %l\n", st.nbread);
+  printf("blocks read: %l\n", st.nread);
+  printf("blocks written: %l\n", st.nwrite);
+  printf("disk requests: %l\n", st.nreq);
+  printf("device notifications: %l\n", st.nnotify);
+  printf("most requests in flight: %l\n", st.maxinflight);
+  printf("disk interrupts: %l\n", st.nintr);
+  printf("waits ended by polling: %l\n", st.npolled);
+  printf("log commits: %l\n", st.ncommit);
+  printf("FS system calls committed: %l\n", st.nops);
+  printf("FS system calls running at once, on average: %l\n",
+         st.nops ? st.concur / st.nops : 0);
+  printf("waits for log space: %l\n", st.nlogwait);
+  printf("read-ahead blocks: %l\n", st.ra_issued);
+  printf("read-ahead hits: %l\n", st.ra_hits);
+  printf("read-ahead wasted: %l\n", st.ra_wasted);
+  exit(0);
+}
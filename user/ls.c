@@ -23,12 +23,16 @@ fmtname(char *path)
   return buf;
 }
 
+#define NENT 128  // entries per getdents()
+
+struct dirent ents[NENT];
+struct stat sts[NENT];
+
 void
 ls(char *path)
 {
   char buf[512], *p;
-  int fd;
-  struct dirent de;
+  int fd, i, n;
   struct stat st;
 
   if((fd = open(path, O_RDONLY)) < 0){
@@ -56,16 +60,23 @@ ls(char *path)
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf("ls: cannot stat %s\n", buf);
-        continue;
+    // A batch of entries, and then their i-nodes, a system
+    // call each.
+    while((n = getdents(fd, ents, sizeof(ents))) > 0){
+      n /= sizeof(ents[0]);
+      if(dirstat(fd, ents, n, sts) < 0){
+        printf("ls: cannot stat %s\n", path);
+        break;
+      }
+      for(i = 0; i < n; i++){
+        memmove(p, ents[i].name, DIRSIZ);
+        p[DIRSIZ] = 0;
+        if(sts[i].type == 0){
+          printf("ls: cannot stat %s\n", buf);
+          continue;
+        }
+        printf("%s %d %d %d\n", fmtname(buf), sts[i].type, sts[i].ino, sts[i].size);
       }
-      printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
     }
     break;
   }
@@ -26,6 +26,16 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int fadvise(int, int, int, int);
+struct iostat;
+int iostat(struct iostat*);
+int iotune(int, int);
+int fsync(int);
+int sync(void);
+struct dirent;
+int getdents(int, struct dirent*, int);
+int fstatat(int, const char*, struct stat*);
+int dirstat(int, struct dirent*, int, struct stat*);
 #ifdef LAB_NET
 int connect(uint32, uint16, uint16);
 #endif
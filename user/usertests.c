@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/iostat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1145,6 +1146,405 @@ sharedfd(char *s)
   }
 }
 
+// sequential reads with read-ahead and fadvise() hints
+// must still return the right data, and a sequential read of
+// blocks that aren't cached must find some read ahead.
+void
+readahead(char *s)
+{
+  enum { N = 40, NFILL = 200 };
+  struct iostat before, after;
+  char fill[] = "ra.fill0";
+  int fd, i, j, advice;
+  int advices[] = { FADV_NORMAL, FADV_SEQUENTIAL, FADV_RANDOM, FADV_WILLNEED };
+
+  unlink("ra.dat");
+  fd = open("ra.dat", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create ra.dat\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write ra.dat failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(advice = 0; advice < sizeof(advices)/sizeof(advices[0]); advice++){
+    fd = open("ra.dat", O_RDONLY);
+    if(fd < 0){
+      printf("%s: cannot open ra.dat\n", s);
+      exit(1);
+    }
+    if(fadvise(fd, 0, 0, advices[advice]) != 0){
+      printf("%s: fadvise %d failed\n", s, advices[advice]);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      // odd-sized reads so that they straddle blocks.
+      int n = (i == N-1) ? BSIZE : BSIZE/3;
+      int off = 0;
+      while(off < BSIZE){
+        if(n > BSIZE - off)
+          n = BSIZE - off;
+        if(read(fd, buf + off, n) != n){
+          printf("%s: read ra.dat failed\n", s);
+          exit(1);
+        }
+        off += n;
+      }
+      if(buf[0] != i || buf[BSIZE-1] != i){
+        printf("%s: read ra.dat wrong data at block %d\n", s, i);
+        exit(1);
+      }
+    }
+    if(read(fd, buf, 1) != 0){
+      printf("%s: read past end of ra.dat\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  // push ra.dat out of the buffer cache with other files'
+  // blocks, each file small enough for any lab's MAXFILE.
+  for(j = 0; j * NFILL < NBUF + N; j++){
+    fill[7] = '0' + j;
+    if((fd = open(fill, O_CREATE | O_TRUNC | O_WRONLY)) < 0){
+      printf("%s: cannot create %s\n", s, fill);
+      exit(1);
+    }
+    for(i = 0; i < NFILL && j * NFILL + i < NBUF + N; i++){
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write %s failed\n", s, fill);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  iostat(&before);
+  fd = open("ra.dat", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != i){
+      printf("%s: read ra.dat wrong data at block %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  iostat(&after);
+  if(after.ra_issued == before.ra_issued || after.ra_hits == before.ra_hits){
+    printf("%s: no read-ahead: %d issued, %d hits\n", s,
+           (int)(after.ra_issued - before.ra_issued), (int)(after.ra_hits - before.ra_hits));
+    exit(1);
+  }
+  for(j = 0; j * NFILL < NBUF + N; j++){
+    fill[7] = '0' + j;
+    unlink(fill);
+  }
+
+  fd = open("ra.dat", O_RDONLY);
+  if(fadvise(fd, 0, 0, 99) != -1){
+    printf("%s: fadvise accepted a bad hint\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fadvise(fd, 0, 0, FADV_NORMAL) != -1){
+    printf("%s: fadvise accepted a closed fd\n", s);
+    exit(1);
+  }
+  unlink("ra.dat");
+}
+
+// fsync() and sync(), with and without async commit.
+void
+fsynctest(char *s)
+{
+  int fd, i, mode, oldasync, fds[2];
+
+  oldasync = iotune(IOT_ASYNC, -1);
+  for(mode = 0; mode < 2; mode++){
+    iotune(IOT_ASYNC, mode);
+    unlink("fsync.dat");
+    fd = open("fsync.dat", O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf("%s: cannot create fsync.dat\n", s);
+      exit(1);
+    }
+    for(i = 0; i < 4; i++){
+      memset(buf, mode + i, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write fsync.dat failed\n", s);
+        exit(1);
+      }
+      if(fsync(fd) != 0){
+        printf("%s: fsync failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    if(sync() != 0){
+      printf("%s: sync failed\n", s);
+      exit(1);
+    }
+    fd = open("fsync.dat", O_RDONLY);
+    for(i = 0; i < 4; i++){
+      if(read(fd, buf, BSIZE) != BSIZE || buf[0] != mode + i){
+        printf("%s: fsync.dat wrong data\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink("fsync.dat");
+  }
+  iotune(IOT_ASYNC, oldasync);
+
+  if(fsync(fd) != -1){
+    printf("%s: fsync accepted a closed fd\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync accepted a pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// a file growing a few bytes at a time past what fits in its
+// i-node with FS_INLINE, and being truncated back.
+void
+inlinefile(char *s)
+{
+  enum { N=100 };
+  char c;
+  int fd, i, round;
+
+  for(round = 0; round < 2; round++){
+    fd = open("inl", O_CREATE | O_TRUNC | O_RDWR);
+    if(fd < 0){
+      printf("%s: cannot create inl\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      c = 'a' + (round + i) % 26;
+      if(write(fd, &c, 1) != 1){
+        printf("%s: write inl failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    fd = open("inl", O_RDONLY);
+    if(read(fd, buf, sizeof(buf)) != N){
+      printf("%s: inl has the wrong size\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(buf[i] != 'a' + (round + i) % 26){
+        printf("%s: inl has the wrong data\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  unlink("inl");
+}
+
+// with delayed allocation, a file appended to in small pieces
+// reads back right while its blocks are in memory, through
+// another descriptor, and after close; truncating or removing
+// it while they are drops them.
+void
+delalloctest(char *s)
+{
+  enum { N=100, NREC=(NDELAY+4)*BSIZE/N };
+  struct iostat before, after;
+  struct stat st;
+  int fd, fd2, i, j, n, off, olddelay;
+
+  olddelay = iotune(IOT_DELALLOC, 1);
+  off = 0;
+  fd = open("da", O_CREATE | O_TRUNC | O_RDWR);
+  fd2 = open("da", O_RDONLY);
+  if(fd < 0 || fd2 < 0){
+    printf("%s: cannot create da\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NREC; i++){
+    memset(buf, 'a' + i % 26, N);
+    if(write(fd, buf, N) != N){
+      printf("%s: write da failed\n", s);
+      exit(1);
+    }
+    if(i % 7 == 0){
+      if((n = read(fd2, buf, BSIZE)) < 0){
+        printf("%s: read da failed\n", s);
+        exit(1);
+      }
+      for(j = 0; j < n; j++){
+        if(buf[j] != 'a' + (off + j) / N % 26){
+          printf("%s: da reads back wrong while written\n", s);
+          exit(1);
+        }
+      }
+      off += n;
+    }
+  }
+  if(fstat(fd, &st) != 0 || st.size != NREC * N){
+    printf("%s: da has the wrong size while written\n", s);
+    exit(1);
+  }
+  close(fd2);
+  close(fd);
+
+  fd = open("da", O_RDONLY);
+  for(i = 0; i < NREC; i++){
+    if(read(fd, buf, N) != N){
+      printf("%s: da has the wrong size\n", s);
+      exit(1);
+    }
+    for(j = 0; j < N; j++){
+      if(buf[j] != 'a' + i % 26){
+        printf("%s: da has the wrong data\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+
+  fd = open("da", O_WRONLY);
+  fd2 = open("da", O_CREATE | O_TRUNC | O_RDWR);
+  if(write(fd2, buf, N) != N || fstat(fd2, &st) != 0 || st.size != N){
+    printf("%s: truncated da has the wrong size\n", s);
+    exit(1);
+  }
+  // closing an unlinked file mustn't write its delayed block.
+  unlink("da");
+  sync();
+  iostat(&before);
+  close(fd2);
+  iostat(&after);
+  if(after.nwrite != before.nwrite){
+    printf("%s: closing unlinked da wrote %d blocks\n", s,
+           (int)(after.nwrite - before.nwrite));
+    exit(1);
+  }
+  close(fd);
+  iotune(IOT_DELALLOC, olddelay);
+}
+
+// getdents() returns each entry in use once, however small the
+// buffer, and skips removed ones; dirstat() and fstatat() find
+// them by name.
+void
+getdentstest(char *s)
+{
+  enum { N=40 };
+  struct dirent de[3];
+  struct stat st[3];
+  char name[] = "gd/f00", seen[N];
+  int fd, i, n, nseen;
+
+  if(mkdir("gd") != 0){
+    printf("%s: mkdir gd failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 10;
+    name[5] = '0' + i % 10;
+    if((fd = open(name, O_CREATE | O_WRONLY)) < 0){
+      printf("%s: cannot create %s\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < N; i += 3){
+    name[4] = '0' + i / 10;
+    name[5] = '0' + i % 10;
+    unlink(name);
+  }
+
+  memset(seen, 0, N);
+  nseen = 0;
+  fd = open("gd", O_RDONLY);
+  while((n = getdents(fd, de, sizeof(de))) > 0){
+    if(dirstat(fd, de, n / sizeof(de[0]), st) != 0){
+      printf("%s: dirstat failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n / sizeof(de[0]); i++){
+      if(de[i].inum == 0){
+        printf("%s: getdents returned a free entry\n", s);
+        exit(1);
+      }
+      if(st[i].ino != de[i].inum || st[i].type != (de[i].name[0] == '.' ? T_DIR : T_FILE)){
+        printf("%s: dirstat of %s wrong\n", s, de[i].name);
+        exit(1);
+      }
+      if(de[i].name[0] == '.')
+        continue;
+      int j = (de[i].name[1] - '0') * 10 + de[i].name[2] - '0';
+      if(j < 0 || j >= N || j % 3 == 0 || seen[j]){
+        printf("%s: getdents returned %s\n", s, de[i].name);
+        exit(1);
+      }
+      seen[j] = 1;
+      nseen++;
+    }
+  }
+  if(n < 0 || nseen != N - (N + 2) / 3){
+    printf("%s: getdents found %d entries\n", s, nseen);
+    exit(1);
+  }
+  if(getdents(fd, de, sizeof(de[0]) - 1) != -1 || getdents(fd, de, -1) != -1){
+    printf("%s: getdents accepted a short buffer\n", s);
+    exit(1);
+  }
+  if(fstatat(fd, "f01", &st[0]) != 0 || st[0].type != T_FILE ||
+     fstatat(fd, "..", &st[1]) != 0 || st[1].type != T_DIR){
+    printf("%s: fstatat failed\n", s);
+    exit(1);
+  }
+  if(fstatat(fd, "f00", &st[0]) != -1){
+    printf("%s: fstatat found removed f00\n", s);
+    exit(1);
+  }
+  strcpy(de[0].name, "f00");
+  if(dirstat(fd, de, 1, st) != 0 || st[0].type != 0){
+    printf("%s: dirstat found removed f00\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 10;
+    name[5] = '0' + i % 10;
+    unlink(name);
+  }
+  fd = open("gd", O_RDONLY);
+  if(getdents(fd, de, sizeof(de)) != 2 * sizeof(de[0])){
+    printf("%s: empty gd has more than . and ..\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("gd") != 0){
+    printf("%s: unlink gd failed\n", s);
+    exit(1);
+  }
+
+  fd = open("echo", O_RDONLY);
+  if(getdents(fd, de, sizeof(de)) != -1){
+    printf("%s: getdents accepted a file\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
 // four processes write different files at the same
 // time, to test block allocation.
 void
@@ -2613,6 +3013,11 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {readahead, "readahead"},
+  {fsynctest, "fsync"},
+  {inlinefile, "inlinefile"},
+  {delalloctest, "delalloc"},
+  {getdentstest, "getdents"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
@@ -2684,6 +3089,70 @@ bigdir(char *s)
   }
 }
 
+// a directory with more entries than fit in a few blocks,
+// which an FS_HTREE file system indexes: links to one file, so
+// as not to run out of i-nodes.
+void
+hashdir(char *s)
+{
+  enum { N=600 };
+  char name[] = "hd/x000";
+  int fd, i;
+
+  if(mkdir("hd") != 0 || (fd = open("hd/f", O_CREATE | O_WRONLY)) < 0){
+    printf("%s: cannot make hd/f\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if(link("hd/f", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 2){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i % 2 == 1)){
+      printf("%s: open %s returned %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+  }
+  for(i = 1; i < N; i += 2){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("hd") == 0){
+    printf("%s: unlinked non-empty hd\n", s);
+    exit(1);
+  }
+  if(unlink("hd/f") != 0 || unlink("hd") != 0){
+    printf("%s: cannot remove hd\n", s);
+    exit(1);
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2926,6 +3395,7 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {hashdir, "hashdir"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
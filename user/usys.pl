@@ -36,6 +36,14 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("fadvise");
+entry("iostat");
+entry("iotune");
+entry("fsync");
+entry("sync");
+entry("getdents");
+entry("fstatat");
+entry("dirstat");
 entry("connect");
 entry("pgaccess");
 entry("trace");